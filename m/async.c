@@ -24,49 +24,71 @@
 
 #include "m.h"
 
-const static uint8_t _reversed_bits[] = {
-	0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
-	0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf,
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+
+const static uint8_t reversed_bits[256] = {
+	R6(0), R6(2), R6(1), R6(3)
 };
 
-#define reverse_bits(a) (_reversed_bits[(a)&0xf] << 4|_reversed_bits[(a)>>4])
+/* start bit, lsb first data, stop bit - as the line sends it */
+#define async_frame(ch) ((reversed_bits[(ch)] << 1) | 1)
 
+/* bits are msb first, num is up to 32; all framed chars are passed
+ * with single put_chars() */
 void async_bitque_put_bits(struct modem *m, unsigned bits, unsigned num)
 {
 	struct async_bitque *q = &m->rx_bitque;
-	q->data <<= num;
-	q->data |= bits & ((1 << num) - 1);
-	q->bits += num;
-	while (q->bits && ((q->data >> (q->bits - 1)) & 1))
-		q->bits--;
-	if (q->bits >= 10) {
-		uint8_t ch = (q->data >> (q->bits - 9)) & 0xff;
-		if (!(q->data >> (q->bits - 10) & 1))
+	uint8_t buf[(ASYNC_MAX_BITS + 9) / 10];
+	uint64_t data = (q->data << num) | (bits & bits_mask(num));
+	unsigned nbits = q->bits + num;
+	unsigned n = 0;
+
+	while (nbits) {
+		/* skip idle (mark) bits: count leading ones */
+		unsigned ones = __builtin_clzll(~(data << (64 - nbits)));
+		if (ones >= nbits) {
+			nbits = 0;
+			break;
+		}
+		nbits -= ones;
+		if (nbits < 10)
+			break;
+		if (!((data >> (nbits - 10)) & 1))
 			dbg("async: no stop bit\n");
-		q->bits -= 10;
-		ch = reverse_bits(ch);
-		dbg("put_char = %02x '%c'\n", ch, ch);
-		if (m->put_chars)
-			m->put_chars(m, &ch, 1);
+		buf[n] = reversed_bits[(data >> (nbits - 9)) & 0xff];
+		dbg("put_char = %02x '%c'\n", buf[n], buf[n]);
+		nbits -= 10;
+		n++;
 	}
+	q->data = data;
+	q->bits = nbits;
+
+	if (n && m->put_chars)
+		m->put_chars(m, buf, n);
 }
 
+/* fetches all chars needed for num bits with single get_chars(), rest
+ * is filled with idle (mark) bits */
 unsigned async_bitque_get_bits(struct modem *m, unsigned num)
 {
 	struct async_bitque *q = &m->tx_bitque;
 	if (q->bits < num) {
-		uint8_t ch;
-		if (m->get_chars && m->get_chars(m, &ch, 1) > 0) {
-			ch = reverse_bits(ch);
-			q->data <<= 10;
-			q->data |= ((ch << 1) | 1) & 0x1ff;
+		uint8_t buf[(ASYNC_MAX_BITS + 9) / 10];
+		int i, n = 0;
+		if (m->get_chars)
+			n = m->get_chars(m, buf, (num - q->bits + 9) / 10);
+		for (i = 0; i < n; i++) {
+			q->data = (q->data << 10) | async_frame(buf[i]);
 			q->bits += 10;
-		} else {
+		}
+		if (q->bits < num) {
 			q->data <<= num - q->bits;
-			q->data |= ((1 << (num - q->bits)) - 1);
+			q->data |= bits_mask(num - q->bits);
 			q->bits = num;
 		}
 	}
 	q->bits -= num;
-	return (q->data >> q->bits) & ((1 << num) - 1);
+	return (q->data >> q->bits) & bits_mask(num);
 }
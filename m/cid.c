@@ -0,0 +1,266 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   cid.c - on hook caller id datapump
+ *
+ *   Bell 202 FSK, 1200 bps async.  A message follows channel seizure
+ *   (alternating bits) and a mark (all ones) period, then goes as
+ *   type, length, data and checksum bytes.  Both single (SDMF) and multiple
+ *   (MDMF) data message formats are parsed.
+ *
+ *   Quiet periods are not demodulated at all, so the idle line costs one
+ *   energy sum per sample.  The datapump is never done by itself, after a
+ *   message it hunts for the next one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "m.h"
+#include "m_dsp.h"
+
+#define CID_MARK_FREQ 1200
+#define CID_SPACE_FREQ 2200
+#define CID_BIT_RATE 1200
+
+#define CID_SQUELCH 30		/* rms, about -60 dBFS */
+#define CID_SEIZURE_MIN 40	/* alternating bits, 300 are sent */
+#define CID_MARK_MIN 40		/* ones, 180 are sent (80 after seizure
+				   is allowed too) */
+#define CID_IDLE_MAX 20		/* ones between bytes */
+#define CID_MSG_MAX (255 + 3)
+
+#define CID_SDMF 0x04
+#define CID_MDMF 0x80
+
+/* MDMF parameters */
+#define CID_PARAM_DATETIME 0x01
+#define CID_PARAM_NUMBER 0x02
+#define CID_PARAM_NUMBER_ABSENT 0x04
+#define CID_PARAM_NAME 0x07
+#define CID_PARAM_NAME_ABSENT 0x08
+
+enum CID_STATE { CID_HUNT = 0, CID_MARK, CID_DATA };
+
+struct cid_struct {
+	struct modem *modem;
+	enum CID_STATE state;
+	unsigned int last_bit;
+	unsigned int count;	/* alternations, ones or idle ones */
+	unsigned int nbits;	/* of current byte, 0 - wait start bit */
+	unsigned int byte;
+	unsigned int len;
+	uint8_t msg[CID_MSG_MAX];
+	struct fsk_demodulator dem;
+};
+
+static void cid_copy(char *dst, unsigned size, const uint8_t * src,
+		     unsigned len)
+{
+	unsigned i;
+	if (len >= size)
+		len = size - 1;
+	for (i = 0; i < len; i++)
+		dst[i] = (src[i] >= ' ' && src[i] < 0x7f) ? src[i] : '?';
+	dst[i] = '\0';
+}
+
+static void cid_datetime(struct cid_info *cid, const uint8_t * p, unsigned len)
+{
+	if (len < 8)
+		return;
+	cid_copy(cid->date, sizeof(cid->date), p, 4);
+	cid_copy(cid->time, sizeof(cid->time), p + 4, 4);
+}
+
+static int cid_parse(struct cid_info *cid, const uint8_t * msg)
+{
+	const uint8_t *p = msg + 2, *end = msg + 2 + msg[1];
+
+	memset(cid, 0, sizeof(*cid));
+	switch (msg[0]) {
+	case CID_SDMF:
+		cid_datetime(cid, p, end - p);
+		if (end - p > 8)
+			cid_copy(cid->number, sizeof(cid->number), p + 8,
+				 end - p - 8);
+		return 0;
+	case CID_MDMF:
+		while (end - p >= 2 && p[1] <= end - p - 2) {
+			switch (p[0]) {
+			case CID_PARAM_DATETIME:
+				cid_datetime(cid, p + 2, p[1]);
+				break;
+			case CID_PARAM_NUMBER:
+			case CID_PARAM_NUMBER_ABSENT:
+				cid_copy(cid->number, sizeof(cid->number),
+					 p + 2, p[1]);
+				break;
+			case CID_PARAM_NAME:
+			case CID_PARAM_NAME_ABSENT:
+				cid_copy(cid->name, sizeof(cid->name),
+					 p + 2, p[1]);
+				break;
+			default:
+				dbg("cid: unknown parameter 0x%02x\n", p[0]);
+				break;
+			}
+			p += 2 + p[1];
+		}
+		return 0;
+	}
+	dbg("cid: unknown message type 0x%02x\n", msg[0]);
+	return -1;
+}
+
+static void cid_message(struct cid_struct *s)
+{
+	struct cid_info cid;
+	uint8_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i < s->len; i++)
+		sum += s->msg[i];
+	if (sum) {
+		dbg("cid: bad checksum, %u bytes message\n", s->len);
+		return;
+	}
+	if (!cid_parse(&cid, s->msg))
+		modem_update_cid(s->modem, &cid);
+}
+
+static void cid_bit(struct cid_struct *s, unsigned bit)
+{
+	switch (s->state) {
+	case CID_HUNT:
+		if (bit != s->last_bit)
+			s->count++;
+		else if (bit && s->count >= CID_SEIZURE_MIN) {
+			s->state = CID_MARK;
+			s->count = 2;
+		} else
+			s->count = 0;
+		break;
+	case CID_MARK:
+		if (bit)
+			s->count++;
+		else if (s->count >= CID_MARK_MIN) {
+			/* the start bit */
+			s->state = CID_DATA;
+			s->nbits = 1;
+			s->byte = 0;
+			s->len = 0;
+		} else {
+			s->state = CID_HUNT;
+			s->count = 1;
+		}
+		break;
+	case CID_DATA:
+		if (!s->nbits) {
+			if (!bit) {
+				s->nbits = 1;
+				s->byte = 0;
+			} else if (++s->count > CID_IDLE_MAX) {
+				dbg("cid: lost after %u bytes\n", s->len);
+				s->state = CID_HUNT;
+				s->count = 0;
+			}
+			break;
+		}
+		if (s->nbits <= 8) {
+			/* lsb first */
+			s->byte |= bit << (s->nbits - 1);
+			s->nbits++;
+			break;
+		}
+		if (!bit) {
+			dbg("cid: framing error after %u bytes\n", s->len);
+			s->state = CID_HUNT;
+			s->count = 0;
+			break;
+		}
+		s->msg[s->len++] = s->byte;
+		s->nbits = 0;
+		s->count = 0;
+		if (s->len > 2 && s->len == s->msg[1] + 3u) {
+			cid_message(s);
+			s->state = CID_HUNT;
+		}
+		break;
+	}
+	s->last_bit = bit;
+}
+
+static void cid_put_bits(struct modem *m, unsigned bits, unsigned num)
+{
+	struct cid_struct *s = (struct cid_struct *)m->datapump.dp;
+	while (num--)
+		cid_bit(s, (bits >> num) & 1);
+}
+
+static int cid_process(struct modem *m, int16_t * in, int16_t * out,
+		       unsigned int count)
+{
+	struct cid_struct *s = (struct cid_struct *)m->datapump.dp;
+	int64_t energy = 0;
+	unsigned int i;
+
+	memset(out, 0, count * sizeof(int16_t));
+	if (s->state == CID_HUNT && !s->count) {
+		for (i = 0; i < count; i++)
+			energy += in[i] * in[i];
+		if (energy < (int64_t) count * CID_SQUELCH * CID_SQUELCH)
+			return count;
+	}
+	fsk_demodulate(&s->dem, in, count);
+	return count;
+}
+
+static void *cid_create(struct modem *m)
+{
+	struct cid_struct *s;
+	s = malloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	s->modem = m;
+	if (fsk_demodulator_init(&s->dem, m, CID_SPACE_FREQ, CID_MARK_FREQ,
+				 CID_BIT_RATE) < 0) {
+		free(s);
+		return NULL;
+	}
+	s->dem.put_bits = cid_put_bits;
+	return s;
+}
+
+static void cid_delete(void *data)
+{
+	struct cid_struct *s = (struct cid_struct *)data;
+	free(s);
+}
+
+const struct dp_operations cid_ops = {
+	.create = cid_create,
+	.delete = cid_delete,
+	.process = cid_process,
+};
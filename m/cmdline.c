@@ -63,6 +63,22 @@ static struct cmdline_option {
 		    &modem_phone_number}, {
 	"test", 't', "test modulation (mtest only)", NULL, 1,
 		    OPTARG_STR, &modulation_test}, {
+	"rtprio", 'r', "run sample thread, SCHED_FIFO priority", NULL, 1,
+		    OPTARG_INT, &modem_rt_priority}, {
+	"cpu", 'c', "run sample thread on cpu", NULL, 1, OPTARG_INT,
+		    &modem_rt_cpu}, {
+	"workers", 'w', "datapump worker threads, 0 - inline", NULL, 1,
+		    OPTARG_INT, &modem_workers}, {
+	"lines", 'N', "lines of multichannel device, ttys get line numbers",
+		    NULL, 1, OPTARG_INT, &modem_lines}, {
+	"cid", 'C', "listen for caller id on hook instead of dialing",
+		    NULL, 1, OPTARG_INT, &modem_cid_mode}, {
+	"tonestep", 'S', "tone decision interval, 0 - per block", NULL,
+		    1, OPTARG_INT, &tonedet_step}, {
+	"latency", 'L', "target round trip latency, msecs, 0 - untuned",
+		    NULL, 1, OPTARG_INT, &modem_latency}, {
+	"drift", 'R', "playback drift compensation limit, ppm, 0 - off",
+		    NULL, 1, OPTARG_INT, &modem_drift}, {
 	"jopa", 0, "jopa kakaya-to", NULL, 1},
 #if 0
 	{
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "m.h"
 #include "m_dsp.h"
@@ -36,82 +37,142 @@
  *  941   *    0    #    D
  */
 
-#define PHINC(f) ((f)*COSTAB_SIZE/SAMPLE_RATE)
+static const uint32_t dtmf_phinc_low[] = {
+	NCO_PHINC(697), NCO_PHINC(770), NCO_PHINC(852), NCO_PHINC(941)
+};
+static const uint32_t dtmf_phinc_high[] = {
+	NCO_PHINC(1209), NCO_PHINC(1336), NCO_PHINC(1477), NCO_PHINC(1633)
+};
+/* digit -> index into the tables above, plus one */
+static const unsigned char dtmf_trans[256] = {
+	['1'] = 1, ['2'] = 2, ['3'] = 3, ['A'] = 4,
+	['4'] = 5, ['5'] = 6, ['6'] = 7, ['B'] = 8,
+	['7'] = 9, ['8'] = 10, ['9'] = 11, ['C'] = 12,
+	['*'] = 13, ['0'] = 14, ['#'] = 15, ['D'] = 16,
+};
+
+/*
+ * Digit waveforms are generated once, as long as the longest tone S11 can
+ * ask for, and shared by all dialers; every digit starts from zero phase,
+ * so sending a digit is just a copy of its first samples.
+ */
+
+#define DTMF_MIN_MSEC 50
+#define DTMF_MAX_MSEC 255
+#define DTMF_WAVE_SIZE samples_in_msec(DTMF_MAX_MSEC)
+
+static int16_t dtmf_waves[16][DTMF_WAVE_SIZE];
+static pthread_once_t dtmf_waves_once = PTHREAD_ONCE_INIT;
 
-static const int16_t dtmf_phinc_low[] =
-    { PHINC(697), PHINC(770), PHINC(852), PHINC(941) };
-static const int16_t dtmf_phinc_high[] =
-    { PHINC(1209), PHINC(1336), PHINC(1477), PHINC(1633) };
-static const char dtmf_trans[] = "123A456B789C*0#D";
+static void dtmf_waves_init(void)
+{
+	int16_t high[DTMF_WAVE_SIZE];
+	struct nco low_nco, high_nco;
+	unsigned i, j;
+	for (i = 0; i < arrsize(dtmf_waves); i++) {
+		int16_t *wave = dtmf_waves[i];
+		low_nco.phase = high_nco.phase = 0;
+		low_nco.phinc = dtmf_phinc_low[i / 4];
+		high_nco.phinc = dtmf_phinc_high[i % 4];
+		nco_generate(&low_nco, wave, DTMF_WAVE_SIZE);
+		nco_generate(&high_nco, high, DTMF_WAVE_SIZE);
+		for (j = 0; j < DTMF_WAVE_SIZE; j++) {
+			int32_t v = wave[j] + high[j];
+			wave[j] = v > INT16_MAX ? INT16_MAX :
+			    v < INT16_MIN ? INT16_MIN : v;
+		}
+	}
+}
 
 /* dtmf stuff */
 struct dtmfgen_state {
 	const char *p;
+	const int16_t *wave;
 	unsigned int duration;
 	unsigned int pause_duration;
 	unsigned int count;
-	unsigned int phinc_low, phinc_high;
-	unsigned int phase_low, phase_high;
 };
 
-void dtmfgen_init(struct dtmfgen_state *s, const char *dial_string)
+void dtmfgen_init(struct dtmfgen_state *s, struct modem *m,
+		  const char *dial_string)
 {
+	/* S11 is both tone and pause length */
+	unsigned int msec = m->sregs[11];
+	if (msec < DTMF_MIN_MSEC)
+		msec = DTMF_MIN_MSEC;
+	pthread_once(&dtmf_waves_once, dtmf_waves_init);
 	memset(s, 0, sizeof(*s));
 	s->p = dial_string;
-	s->duration = samples_in_msec(200);
-	s->pause_duration = samples_in_msec(100);
+	s->duration = samples_in_msec(2 * msec);
+	s->pause_duration = samples_in_msec(msec);
 }
 
 static int dtmfgen_process(struct dtmfgen_state *s, int16_t * buf,
 			   unsigned count)
 {
-	int i;
-	for (i = 0; i < count; i++) {
+	unsigned i = 0, n;
+	while (i < count) {
 		if (s->count == 0) {
-			unsigned idx;
-			const char *p = strchr(dtmf_trans, *s->p);
-			if (!p || !*p)
+			unsigned idx = dtmf_trans[(unsigned char)*s->p];
+			if (!idx)
 				break;
+			dbg("dtmfgen: %c...\n", *s->p);
 			s->p++;
-			dbg("dtmfgen: %c...\n", *p);
-			idx = p - dtmf_trans;
-			s->phase_low = s->phase_high = 0;
-			s->phinc_low = dtmf_phinc_low[idx / 4];
-			s->phinc_high = dtmf_phinc_high[idx % 4];
+			s->wave = dtmf_waves[idx - 1];
 			s->count = s->duration;
-		} else if (s->count == s->pause_duration) {
-			s->phase_low = s->phase_high = 0;
-			s->phinc_low = s->phinc_high = 0;
 		}
-		buf[i] = (m_sin(s->phase_low) + m_sin(s->phase_high));
-		s->phase_low += s->phinc_low;
-		s->phase_high += s->phinc_high;
-		s->count--;
+		/* tone pair, then silence till the next digit */
+		if (s->count > s->pause_duration) {
+			unsigned pos = s->duration - s->count;
+			n = s->count - s->pause_duration;
+			if (n > count - i)
+				n = count - i;
+			memcpy(buf + i, s->wave + pos, n * sizeof(*buf));
+		} else {
+			n = s->count < count - i ? s->count : count - i;
+			memset(buf + i, 0, n * sizeof(*buf));
+		}
+		s->count -= n;
+		i += n;
 	}
 	return i;
 }
 
 /*
- * detector part (empty yet)
+ * detector part: waits for dial tone, or just the time if none is asked
+ * for or it does not come
  */
 
 struct detector_state {
-	void *foo;
-	int count;
+	struct tonedet tonedet;
+	unsigned int dialtone;
+	unsigned int count;
 };
 
-static void detector_init(struct detector_state *s, int count)
+static void detector_init(struct detector_state *s, struct modem *m,
+			  unsigned int count, unsigned int dialtone)
 {
 	s->count = count;
+	s->dialtone = dialtone;
+	if (!dialtone)
+		return;
+	tonedet_init(&s->tonedet, tonedet_step > 0 ? tonedet_step : 0,
+		     samples_in_msec(m->sregs[9] * 100));
+	tonedet_add_signal(&s->tonedet, SIGNAL_DIALTONE);
 }
 
-static int detector_process(struct detector_state *s, int16_t * buf,
-			    unsigned int count)
+static int detector_process(struct modem *m, struct detector_state *s,
+			    int16_t * buf, unsigned int count)
 {
-	int ret = s->count > count ? count : s->count;
-	s->count -= count;
-	if (s->count < 0)
-		s->count = 0;
+	unsigned int ret = s->count > count ? count : s->count;
+	if (s->dialtone && ret) {
+		ret = tonedet_process(&s->tonedet, buf, ret);
+		if (s->tonedet.detected) {
+			modem_update_signals(m, s->tonedet.detected);
+			s->count = ret;
+		}
+	}
+	s->count -= ret;
 	return ret;
 }
 
@@ -149,7 +210,7 @@ static int dialer_process(struct modem *m, int16_t * in, int16_t * out,
 
 	switch (s->state) {
 	case STATE_WAIT:
-		ret = detector_process(&s->detector, in, count);
+		ret = detector_process(m, &s->detector, in, count);
 		memset(out, 0, ret * sizeof(int16_t));
 		break;
 	case STATE_DIAL:
@@ -175,10 +236,11 @@ static int dialer_process(struct modem *m, int16_t * in, int16_t * out,
 	} else if (tolower(*p) == 'w' || *p == ',') {
 		unsigned int pause_time = m->sregs[8] > 0 ? m->sregs[8] : 2;
 		new_state = STATE_WAIT;
-		detector_init(&s->detector, samples_in_sec(pause_time));
+		detector_init(&s->detector, m, samples_in_sec(pause_time),
+			      tolower(*p) == 'w');
 	} else {
 		new_state = STATE_DIAL;
-		dtmfgen_init(&s->dtmfgen, p);
+		dtmfgen_init(&s->dtmfgen, m, p);
 	}
 	dbg("dialer state: %s -> %s\n",
 	    STATE_NAME(s->state), STATE_NAME(new_state));
@@ -196,9 +258,10 @@ static void *dialer_create(struct modem *m)
 	memset(s, 0, sizeof(*s));
 	s->d_ptr = m->dial_string;
 	s->state = STATE_WAIT;
+	/* blind dialing after S6 seconds */
 	wait_before_dial = m->sregs[6] > 0 ? m->sregs[6] : 2;
-	detector_init(&s->detector, samples_in_sec(wait_before_dial));
-	dtmfgen_init(&s->dtmfgen, m->dial_string);
+	detector_init(&s->detector, m, samples_in_sec(wait_before_dial), 1);
+	dtmfgen_init(&s->dtmfgen, m, m->dial_string);
 	return s;
 }
 
@@ -32,92 +32,435 @@
 #include <alsa/asoundlib.h>
 
 #include "m.h"
+#include "m_dsp.h"
 
 //#define FILE_HACK "in.raw"
 
+#define ALSA_MIN_PERIOD 16
+#define ALSA_LATENCY_WINDOW (5 * SAMPLE_RATE)	/* frames per report */
+#define ALSA_CLEAN_WINDOWS 6	/* without xruns before prefill is trimmed */
+#define ALSA_MAX_PREFILL (SAMPLE_RATE / 2)
+#define ALSA_DRIFT_GAIN 4	/* windows the drift estimate settles in */
+#define ALSA_DRIFT_CENTRE (60 * SAMPLE_RATE)	/* frames to pull back in */
+
 struct alsa_device {
 	int fd;
 	snd_pcm_t *ppcm, *cpcm;
 	snd_pcm_uframes_t period_size;
 	snd_pcm_uframes_t buffer_size;
 	unsigned sample_rate;
+	unsigned channels;
 	snd_mixer_t *mixer;
 	snd_mixer_elem_t *hook_off_elem, *cid_elem, *speaker_elem;
 	snd_output_t *log;
+	/* mmap access: per stream, zero copy when both have it */
+	unsigned int pmmap, cmmap;
+	snd_pcm_uframes_t poffset, coffset;
+	unsigned int setup;	/* hw params are set */
+	snd_pcm_uframes_t lost;	/* by capture xrun, not reported yet */
+	/* latency: round trip is measured every period, playback prefill
+	 * follows the xrun rate and sizes the buffer on next setup */
+	snd_pcm_uframes_t target;	/* 0 - not tuned */
+	snd_pcm_uframes_t prefill, prefill_min;
+	snd_pcm_sframes_t delay;	/* average of the last window */
+	snd_pcm_sframes_t delay_min, delay_max;
+	long delay_sum;
+	unsigned int delay_count;
+	unsigned int xruns, window_xruns, clean_windows;
+	/* drift: capture and playback clocks differ a little, playback is
+	 * resampled so the round trip stays where it was after start */
+	unsigned int resample;	/* step limit, ppm, 0 - off */
+	struct resampler rs;
+	int16_t *rs_buf;
+	int64_t drift;		/* estimated step - 1, 32.32 */
+	int64_t drift_ref, drift_last;	/* window average, 24.8 */
+	unsigned int drift_valid;
 };
 
-static int alsa_xrun_recovery(struct alsa_device *dev)
+/* the playback part of the round trip, as silence */
+static int alsa_prefill(struct alsa_device *dev)
 {
+	snd_pcm_uframes_t len, max, n;
+	void *buf;
 	int ret;
-	dbg("xrun, try to recover...\n");
-	ret = snd_pcm_prepare(dev->ppcm);
-	if (ret < 0) {
-		err("cannot prepare playback: %s\n", snd_strerror(ret));
-		return ret;
+
+	buf = alloca(snd_pcm_frames_to_bytes(dev->ppcm, dev->period_size));
+	if (!buf) {
+		err("cannot alloca %lu frames\n", dev->period_size);
+		return -1;
 	}
-#if 0
-	int len = dev->delay - INTERNAL_DELAY;
-	snd_pcm_format_set_silence(SND_PCM_FORMAT_S16_LE, outbuf, len);
-	ret = snd_pcm_writei(dev->ppcm, outbuf, len);
+	ret = snd_pcm_format_set_silence(SND_PCM_FORMAT_S16_LE, buf,
+					 dev->period_size * dev->channels);
 	if (ret < 0) {
-		err("write error: %s\n", snd_strerror(ret));
+		err("silence error\n");
 		return ret;
 	}
-	ret = snd_pcm_start(dev->cpcm);
+
+	len = dev->prefill;
+	max = dev->buffer_size - 2 * dev->period_size;
+	if (len > max)
+		len = max;
+	dbg("prefill write: %lu...\n", len);
+	while (len) {
+		n = len < dev->period_size ? len : dev->period_size;
+		ret = dev->pmmap ? snd_pcm_mmap_writei(dev->ppcm, buf, n) :
+		    snd_pcm_writei(dev->ppcm, buf, n);
+		if (ret < 0) {
+			err("prefill write error: %s\n", snd_strerror(ret));
+			return ret;
+		}
+		len -= ret;
+	}
+	return 0;
+}
+
+static int64_t alsa_ts_diff(const snd_htimestamp_t * a,
+			    const snd_htimestamp_t * b)
+{
+	return (int64_t) (a->tv_sec - b->tv_sec) * 1000000000 +
+	    a->tv_nsec - b->tv_nsec;
+}
+
+/* brings streams back to how they were after start: playback prefilled,
+ * capture running. What capture has missed - unread frames dropped with
+ * the overrun and the time it was stopped - goes to dev->lost, the
+ * datapump runs that much silence so its timing stays */
+static int alsa_xrun_recovery(struct alsa_device *dev)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t xrun_ts, start_ts;
+	snd_pcm_uframes_t lost = 0;
+	int ret, capture;
+
+	snd_pcm_status_alloca(&status);
+	dev->xruns++;
+	dev->window_xruns++;
+	capture = (snd_pcm_state(dev->cpcm) == SND_PCM_STATE_XRUN);
+	dbg("%s xrun, try to recover...\n", capture ? "capture" : "playback");
+
+	if (capture) {
+		ret = snd_pcm_status(dev->cpcm, status);
+		if (ret < 0) {
+			err("cannot get capture status: %s\n",
+			    snd_strerror(ret));
+			return ret;
+		}
+		lost = snd_pcm_status_get_avail(status);
+		snd_pcm_status_get_trigger_htstamp(status, &xrun_ts);
+		/* playback is late now as well */
+		snd_pcm_drop(dev->ppcm);
+		ret = snd_pcm_prepare(dev->cpcm);
+		if (ret < 0) {
+			err("cannot prepare capture: %s\n", snd_strerror(ret));
+			return ret;
+		}
+	}
+	ret = snd_pcm_prepare(dev->ppcm);
 	if (ret < 0) {
-		err("snd_pcm_start error: %s\n", snd_strerror(ret));
+		err("cannot prepare playback: %s\n", snd_strerror(ret));
 		return ret;
 	}
+	ret = alsa_prefill(dev);
+	if (ret < 0)
+		return ret;
+	dev->drift_valid = 0;
+
+	if (capture) {
+#ifndef USE_PCM_LINK		/* linked capture is started by playback */
+		ret = snd_pcm_start(dev->cpcm);
+		if (ret < 0) {
+			err("snd_pcm_start error: %s\n", snd_strerror(ret));
+			return ret;
+		}
 #endif
-	dbg("alsa xrun: recovered.\n");
+		if (snd_pcm_status(dev->cpcm, status) == 0) {
+			snd_pcm_status_get_trigger_htstamp(status, &start_ts);
+			lost += (alsa_ts_diff(&start_ts, &xrun_ts) *
+				 dev->sample_rate + 500000000) / 1000000000;
+		}
+		dev->lost += lost;
+	}
+	dbg("alsa xrun: recovered, %lu frames lost.\n", lost);
 	return 0;
 }
 
-static int alsa_read(struct modem *m, void *buf, unsigned count)
+static int alsa_dev_read(struct alsa_device *dev, void *buf, unsigned count)
 {
-	struct alsa_device *dev = m->device_data;
 	int ret;
 	trace("%d", count);
+	if (count > dev->period_size)
+		count = dev->period_size;
 #ifdef FILE_HACK
 	ret = read(dev->fd, buf, count * sizeof(int16_t));
 	return ret / sizeof(int16_t);
 #endif
-	do {
-		ret = snd_pcm_readi(dev->cpcm, buf, count);
-		if (ret == -EPIPE) {
-			ret = alsa_xrun_recovery(dev);
+	for (;;) {
+		ret = dev->cmmap ? snd_pcm_mmap_readi(dev->cpcm, buf, count) :
+		    snd_pcm_readi(dev->cpcm, buf, count);
+		if (ret == -EAGAIN)
+			continue;
+		/* after recovery the period is just read late */
+		if (ret != -EPIPE || (ret = alsa_xrun_recovery(dev)) < 0)
 			break;
-		}
-	} while (ret == -EAGAIN);
+	}
 	return ret;
 }
 
-static int alsa_write(struct modem *m, void *buf, unsigned count)
+static int alsa_dev_write(struct alsa_device *dev, void *buf, unsigned count)
 {
-	struct alsa_device *dev = m->device_data;
 	int written = 0;
 	trace("%d", count);
 	while (count > 0) {
-		int ret = snd_pcm_writei(dev->ppcm, buf, count);
+		int ret = dev->pmmap ?
+		    snd_pcm_mmap_writei(dev->ppcm, buf, count) :
+		    snd_pcm_writei(dev->ppcm, buf, count);
 		if (ret < 0) {
 			if (ret == -EAGAIN)
 				continue;
-			if (ret == -EPIPE) {
-				ret = alsa_xrun_recovery(dev);
-			}
+			/* the rest is late, playback is prefilled again */
+			if (ret == -EPIPE &&
+			    (ret = alsa_xrun_recovery(dev)) == 0)
+				ret = written + count;
 			written = ret;
 			break;
 		}
 		count -= ret;
-		buf += ret;
+		buf += snd_pcm_frames_to_bytes(dev->ppcm, ret);
 		written += ret;
 	}
 	return written;
 }
 
+/* xruns in the window raise the prefill by a period, long clean runs trim
+ * it back towards the target; it is taken on next (re)start */
+static void alsa_adapt(struct alsa_device *dev)
+{
+	snd_pcm_uframes_t step;
+
+	if (dev->window_xruns) {
+		dev->clean_windows = 0;
+		if (dev->prefill + dev->period_size > ALSA_MAX_PREFILL)
+			return;
+		dev->prefill += dev->period_size;
+		dbg("alsa: %u xruns, prefill is raised to %lu\n",
+		    dev->window_xruns, dev->prefill);
+		return;
+	}
+	if (++dev->clean_windows < ALSA_CLEAN_WINDOWS ||
+	    dev->prefill <= dev->prefill_min)
+		return;
+	dev->clean_windows = 0;
+	step = dev->period_size / 2;
+	if (step > dev->prefill - dev->prefill_min)
+		step = dev->prefill - dev->prefill_min;
+	dev->prefill -= step;
+	dbg("alsa: prefill is trimmed to %lu\n", dev->prefill);
+}
+
+/* the round trip moves by the clock difference: the slope over a window
+ * corrects the step estimate, the distance from the reference taken
+ * after (re)start pulls the round trip back slowly */
+static void alsa_drift(struct alsa_device *dev)
+{
+	int64_t avg, slope, step, limit;
+
+	if (!dev->resample)
+		return;
+	avg = ((int64_t) dev->delay_sum << 8) / dev->delay_count;
+	if (dev->window_xruns || !dev->drift_valid) {
+		/* prefill was written in the window, take the next one */
+		dev->drift_ref = dev->drift_last = avg;
+		dev->drift_valid = !dev->window_xruns;
+		return;
+	}
+
+	limit = (int64_t) dev->resample * RESAMPLE_ONE / 1000000;
+	step = dev->rs.step - RESAMPLE_ONE;
+	slope = ((avg - dev->drift_last) << 24) /
+	    (int64_t) (dev->delay_count * dev->period_size);
+	dev->drift += (step + slope - dev->drift) / ALSA_DRIFT_GAIN;
+	if (dev->drift > limit)
+		dev->drift = limit;
+	else if (dev->drift < -limit)
+		dev->drift = -limit;
+	dev->drift_last = avg;
+
+	step = dev->drift + ((avg - dev->drift_ref) << 24) / ALSA_DRIFT_CENTRE;
+	if (step > limit)
+		step = limit;
+	else if (step < -limit)
+		step = -limit;
+	dev->rs.step = RESAMPLE_ONE + step;
+	dbg("alsa: drift %ld ppm, round trip %+ld frames off, step %+ld ppm\n",
+	    (long)((dev->drift * 1000000) >> 32),
+	    (long)((avg - dev->drift_ref) >> 8), (long)((step * 1000000) >> 32));
+}
+
+/* capture to playback delay: what waits to be read plus what waits to
+ * be played, once per period */
+static void alsa_measure(struct alsa_device *dev)
+{
+	snd_pcm_sframes_t cdelay, pdelay, delay;
+
+	if (snd_pcm_delay(dev->cpcm, &cdelay) < 0 ||
+	    snd_pcm_delay(dev->ppcm, &pdelay) < 0)
+		return;
+	delay = cdelay + pdelay;
+	if (!dev->delay_count || delay < dev->delay_min)
+		dev->delay_min = delay;
+	if (!dev->delay_count || delay > dev->delay_max)
+		dev->delay_max = delay;
+	dev->delay_sum += delay;
+	if (++dev->delay_count * dev->period_size < ALSA_LATENCY_WINDOW)
+		return;
+
+	dev->delay = dev->delay_sum / dev->delay_count;
+	dbg("alsa: round trip %ld..%ld, avg %ld frames (%ld ms), "
+	    "prefill %lu, xruns %u/%u\n", dev->delay_min, dev->delay_max,
+	    dev->delay, dev->delay * 1000 / dev->sample_rate, dev->prefill,
+	    dev->window_xruns, dev->xruns);
+	alsa_drift(dev);
+	alsa_adapt(dev);
+	dev->delay_sum = 0;
+	dev->delay_count = 0;
+	dev->window_xruns = 0;
+}
+
+/* lost frames are run through the datapump before the next period */
+static void alsa_report_lost(struct modem *m, struct alsa_device *dev)
+{
+	m->dev_lost += dev->lost;
+	dev->lost = 0;
+}
+
+static int alsa_read(struct modem *m, void *buf, unsigned count)
+{
+	struct alsa_device *dev = m->device_data;
+	int ret = alsa_dev_read(dev, buf, count);
+	alsa_report_lost(m, dev);
+	return ret;
+}
+
+/* count frames are taken, the step decides how many are played */
+static int alsa_resample_write(struct alsa_device *dev, int16_t * buf,
+			       unsigned count)
+{
+	unsigned done, n;
+	int ret;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done < PERIOD_SIZE ? count - done : PERIOD_SIZE;
+		ret = resample(&dev->rs, buf + done, n, dev->rs_buf,
+			       2 * PERIOD_SIZE);
+		ret = alsa_dev_write(dev, dev->rs_buf, ret);
+		if (ret < 0)
+			return ret;
+	}
+	return count;
+}
+
+static int alsa_write(struct modem *m, void *buf, unsigned count)
+{
+	struct alsa_device *dev = m->device_data;
+	int ret = dev->resample ? alsa_resample_write(dev, buf, count) :
+	    alsa_dev_write(dev, buf, count);
+	if (ret > 0)
+		alsa_measure(dev);
+	alsa_report_lost(m, dev);
+	return ret;
+}
+
+/* like blocking read/write: waits until count frames can be taken */
+static snd_pcm_sframes_t alsa_mmap_avail(snd_pcm_t * pcm,
+					 snd_pcm_uframes_t count)
+{
+	snd_pcm_sframes_t avail;
+	int ret;
+	while ((avail = snd_pcm_avail_update(pcm)) >= 0 &&
+	       avail < (snd_pcm_sframes_t) count)
+		if ((ret = snd_pcm_wait(pcm, -1)) < 0)
+			return ret;
+	return avail;
+}
+
+static int16_t *alsa_mmap_area(const snd_pcm_channel_area_t * area,
+			       snd_pcm_uframes_t offset)
+{
+	return (int16_t *) ((char *)area->addr +
+			    (area->first + offset * area->step) / 8);
+}
+
+static int alsa_mmap_begin(struct modem *m, int16_t ** in, int16_t ** out,
+			   unsigned count, unsigned more)
+{
+	struct alsa_device *dev = m->device_data;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t cframes = count, pframes = count, wait;
+	snd_pcm_sframes_t ret;
+
+#ifdef FILE_HACK
+	return -ENOSYS;
+#endif
+	if (!dev->pmmap || !dev->cmmap)
+		return -ENOSYS;
+
+	/* waits for a period at most, so short periods are not merged; the
+	 * rest of a period after its first piece is taken only if there */
+	if (more) {
+		if ((ret = snd_pcm_avail_update(dev->cpcm)) < 0)
+			goto _error;
+		if (ret < (snd_pcm_sframes_t) count)
+			return 0;
+	}
+	wait = count < dev->period_size ? count : dev->period_size;
+	if ((ret = alsa_mmap_avail(dev->cpcm, wait)) < 0 ||
+	    (ret = alsa_mmap_avail(dev->ppcm, wait)) < 0)
+		goto _error;
+	if ((ret = snd_pcm_mmap_begin(dev->cpcm, &careas, &dev->coffset,
+				      &cframes)) < 0 ||
+	    (ret = snd_pcm_mmap_begin(dev->ppcm, &pareas, &dev->poffset,
+				      &pframes)) < 0)
+		goto _error;
+
+	*in = alsa_mmap_area(careas, dev->coffset);
+	*out = alsa_mmap_area(pareas, dev->poffset);
+	/* the shorter one, the rest is for the next time */
+	return cframes < pframes ? cframes : pframes;
+_error:
+	if (ret == -EPIPE) {
+		ret = alsa_xrun_recovery(dev);
+		alsa_report_lost(m, dev);
+		return ret;
+	}
+	err("mmap begin error: %s\n", snd_strerror(ret));
+	return ret;
+}
+
+static int alsa_mmap_commit(struct modem *m, unsigned count)
+{
+	struct alsa_device *dev = m->device_data;
+	snd_pcm_sframes_t ret;
+	if ((ret = snd_pcm_mmap_commit(dev->cpcm, dev->coffset, count)) < 0 ||
+	    (ret = snd_pcm_mmap_commit(dev->ppcm, dev->poffset, count)) < 0) {
+		if (ret == -EPIPE) {
+			ret = alsa_xrun_recovery(dev);
+			/* this part was run through already */
+			dev->lost = dev->lost > count ? dev->lost - count : 0;
+			alsa_report_lost(m, dev);
+			return ret;
+		}
+		err("mmap commit error: %s\n", snd_strerror(ret));
+		return ret;
+	}
+	alsa_measure(dev);
+	return count;
+}
+
+/* mmap access is taken if asked and possible, *mmap tells what is set */
 static int setup_stream(struct alsa_device *dev, snd_pcm_t * pcm,
-			const char *stream_name)
+			const char *stream_name, unsigned *mmap)
 {
+	snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
 	snd_pcm_hw_params_t *hw_params;
 	snd_pcm_sw_params_t *sw_params;
 	unsigned int rrate;
@@ -134,8 +477,14 @@ static int setup_stream(struct alsa_device *dev, snd_pcm_t * pcm,
 		return ret;
 	}
 
-	ret = snd_pcm_hw_params_set_access(pcm, hw_params,
-					   SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (*mmap && snd_pcm_hw_params_test_access(pcm, hw_params,
+						   SND_PCM_ACCESS_MMAP_INTERLEAVED)
+	    == 0)
+		access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	*mmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	dbg("%s access for %s\n", *mmap ? "mmap" : "rw", stream_name);
+
+	ret = snd_pcm_hw_params_set_access(pcm, hw_params, access);
 	if (ret < 0) {
 		err("cannot set access for %s: %s\n",
 		    stream_name, snd_strerror(ret));
@@ -150,7 +499,7 @@ static int setup_stream(struct alsa_device *dev, snd_pcm_t * pcm,
 		return ret;
 	}
 
-	ret = snd_pcm_hw_params_set_channels(pcm, hw_params, 1);
+	ret = snd_pcm_hw_params_set_channels(pcm, hw_params, dev->channels);
 	if (ret < 0) {
 		err("cannot set channels for %s: %s\n", stream_name,
 		    snd_strerror(ret));
@@ -263,11 +612,50 @@ static int setup_stream(struct alsa_device *dev, snd_pcm_t * pcm,
 	return 0;
 }
 
-static int alsa_start(struct modem *m)
+/* period is a third of the target round trip, buffer leaves room for
+ * what xruns made the prefill grow to */
+static int alsa_dev_setup(struct alsa_device *dev)
+{
+	snd_pcm_uframes_t period = PERIOD_SIZE;
+	int ret;
+
+	if (dev->target) {
+		period = dev->target / 3;
+		if (period < ALSA_MIN_PERIOD)
+			period = ALSA_MIN_PERIOD;
+		if (period > PERIOD_SIZE)
+			period = PERIOD_SIZE;
+	}
+	dev->period_size = period;
+	dev->buffer_size = period * 16;
+	if (dev->buffer_size < dev->prefill + 4 * period)
+		dev->buffer_size = dev->prefill + 4 * period;
+
+	/* resampled playback is written from own buffer */
+	dev->pmmap = !dev->resample;
+	dev->cmmap = 1;
+	ret = setup_stream(dev, dev->ppcm, "playback", &dev->pmmap);
+	if (ret < 0)
+		return ret;
+	ret = setup_stream(dev, dev->cpcm, "capture", &dev->cmmap);
+	if (ret < 0)
+		return ret;
+
+	/* the period could be changed by hw */
+	if (dev->target > 2 * dev->period_size)
+		dev->prefill_min = dev->target - dev->period_size;
+	else if (dev->target)
+		dev->prefill_min = dev->period_size;
+	else
+		dev->prefill_min = dev->period_size * 4;
+	if (dev->prefill < dev->prefill_min)
+		dev->prefill = dev->prefill_min;
+	dev->setup = 1;
+	return 0;
+}
+
+static int alsa_dev_start(struct alsa_device *dev)
 {
-	struct alsa_device *dev = m->device_data;
-	void *buf;
-	unsigned len;
 	int ret;
 
 	trace();
@@ -280,24 +668,19 @@ static int alsa_start(struct modem *m)
 	}
 #endif
 
-	len = dev->period_size * 4; // dev->buffer_size;
-	buf = alloca(snd_pcm_frames_to_bytes(dev->ppcm, len));
-	if (!buf) {
-		err("cannot alloca %d frames\n", len);
-		return -1;
-	}
-
-	ret = snd_pcm_format_set_silence(SND_PCM_FORMAT_S16_LE, buf, len);
-	if (ret < 0) {
-		err("silence error\n");
+	if (!dev->setup && (ret = alsa_dev_setup(dev)) < 0)
 		return ret;
-	}
 
-	dbg("startup write: %d...\n", len);
-	ret = snd_pcm_writei(dev->ppcm, buf, len);
-	if (ret < 0) {
-		err("startup write error\n");
+	ret = alsa_prefill(dev);
+	if (ret < 0)
 		return ret;
+	dev->delay_sum = 0;
+	dev->delay_count = 0;
+	if (dev->resample) {
+		/* the clocks are the same, the round trip is new */
+		resampler_reset(&dev->rs);
+		dev->rs.step = RESAMPLE_ONE + dev->drift;
+		dev->drift_valid = 0;
 	}
 #ifndef USE_PCM_LINK			/* autostart is used */
 	ret = snd_pcm_start(dev->cpcm);
@@ -309,9 +692,8 @@ static int alsa_start(struct modem *m)
 	return 0;
 }
 
-static int alsa_stop(struct modem *m)
+static int alsa_dev_stop(struct alsa_device *dev)
 {
-	struct alsa_device *dev = m->device_data;
 	trace();
 	snd_pcm_drop(dev->cpcm);
 	snd_pcm_nonblock(dev->ppcm, 0);
@@ -320,9 +702,31 @@ static int alsa_stop(struct modem *m)
 	snd_pcm_unlink(dev->cpcm);
 	snd_pcm_hw_free(dev->ppcm);
 	snd_pcm_hw_free(dev->cpcm);
+	dev->setup = 0;
+	dbg("alsa: stopped, round trip %ld frames, prefill %lu, xruns %u, "
+	    "drift %ld ppm\n", dev->delay, dev->prefill, dev->xruns,
+	    (long)((dev->drift * 1000000) >> 32));
 	return 0;
 }
 
+static int alsa_start(struct modem *m)
+{
+	return alsa_dev_start(m->device_data);
+}
+
+static int alsa_stop(struct modem *m)
+{
+	return alsa_dev_stop(m->device_data);
+}
+
+/* measured round trip, the running average before the first report */
+static int alsa_dev_delay(struct alsa_device *dev)
+{
+	if (dev->delay || !dev->delay_count)
+		return dev->delay;
+	return dev->delay_sum / dev->delay_count;
+}
+
 static int alsa_ctrl(struct modem *m, unsigned int cmd, unsigned long arg)
 {
 	struct alsa_device *dev = m->device_data;
@@ -340,6 +744,8 @@ static int alsa_ctrl(struct modem *m, unsigned int cmd, unsigned long arg)
 		return (dev->speaker_elem) ?
 		    snd_mixer_selem_set_playback_volume_all(dev->speaker_elem,
 							    arg) : 0;
+	case MDRV_CTRL_DELAY:
+		return alsa_dev_delay(dev);
 	}
 	return -EINVAL;
 }
@@ -403,27 +809,25 @@ _error:
 	return ret;
 }
 
-static int alsa_open(struct modem *m, const char *dev_name)
+/* returns poll fd, line switches are looked up for mono devices only */
+static int alsa_dev_open(struct alsa_device **pdev, const char *alsa_name,
+			 unsigned channels)
 {
 	struct pollfd pollfd;
 	struct alsa_device *dev;
-	const char *alsa_name;
 	int ret;
 
-	trace();
+	trace("%s, %u", alsa_name, channels);
 
-	alsa_name = dev_name;
-	if (!alsa_name)
-		alsa_name = modem_device_name;
 	dev = malloc(sizeof(*dev));
 	if (!dev) {
 		err("no mem: %s\n", strerror(errno));
 		return -1;
 	}
 	memset(dev, 0, sizeof(*dev));
+	dev->channels = channels;
 
-	ret = alsa_mixer_setup(dev, alsa_name);
-	if (ret < 0)
+	if (channels == 1 && (ret = alsa_mixer_setup(dev, alsa_name)) < 0)
 		dbg("cannot setup mixer: %s\n", snd_strerror(ret));
 
 	ret = snd_pcm_open(&dev->ppcm, alsa_name, SND_PCM_STREAM_PLAYBACK, 0);
@@ -440,17 +844,24 @@ static int alsa_open(struct modem *m, const char *dev_name)
 		goto _error;
 	}
 
-	dev->period_size = PERIOD_SIZE;
-	dev->buffer_size = dev->period_size * 16;
 	dev->sample_rate = SAMPLE_RATE;
+	if (modem_latency > 0)
+		dev->target = modem_latency * dev->sample_rate / 1000;
 
-	ret = setup_stream(dev, dev->ppcm, "playback");
-	if (ret < 0)
-		return ret;
+	/* lines of a group share the clocks, no compensation for them */
+	if (channels == 1 && modem_drift > 0) {
+		dev->rs_buf = malloc(2 * PERIOD_SIZE * sizeof(*dev->rs_buf));
+		if (!dev->rs_buf || resampler_init(&dev->rs, PERIOD_SIZE) < 0) {
+			err("no mem: %s\n", strerror(errno));
+			ret = -ENOMEM;
+			goto _error;
+		}
+		dev->resample = modem_drift;
+	}
 
-	ret = setup_stream(dev, dev->cpcm, "capture");
+	ret = alsa_dev_setup(dev);
 	if (ret < 0)
-		return ret;
+		goto _error;
 
 	ret = snd_pcm_poll_descriptors(dev->cpcm, &pollfd, 1);
 	if (ret <= 0) {
@@ -464,7 +875,7 @@ static int alsa_open(struct modem *m, const char *dev_name)
 	if (debug_level > 0)
 		snd_pcm_dump(dev->ppcm, dev->log);
 
-	m->device_data = dev;
+	*pdev = dev;
 #ifdef FILE_HACK
 	int fd = open(FILE_HACK, O_RDONLY);
 	if (!fd) {
@@ -483,15 +894,28 @@ _error:
 		snd_pcm_close(dev->cpcm);
 	if (dev->mixer)
 		snd_mixer_close(dev->mixer);
+	resampler_free(&dev->rs);
+	free(dev->rs_buf);
 	free(dev);
 	return ret;
 }
 
-static int alsa_close(struct modem *m)
+static int alsa_open(struct modem *m, const char *dev_name)
+{
+	struct alsa_device *dev;
+	int ret;
+
+	trace();
+	ret = alsa_dev_open(&dev, dev_name ? dev_name : modem_device_name, 1);
+	if (ret < 0)
+		return ret;
+	m->device_data = dev;
+	return ret;
+}
+
+static int alsa_dev_close(struct alsa_device *dev)
 {
-	struct alsa_device *dev = m->device_data;
 	trace();
-	m->device_data = NULL;
 	snd_pcm_close(dev->ppcm);
 	snd_pcm_close(dev->cpcm);
 	if (dev->mixer) {
@@ -511,10 +935,19 @@ static int alsa_close(struct modem *m)
 #ifdef FILE_HACK
 	close(dev->fd);
 #endif
+	resampler_free(&dev->rs);
+	free(dev->rs_buf);
 	free(dev);
 	return 0;
 }
 
+static int alsa_close(struct modem *m)
+{
+	struct alsa_device *dev = m->device_data;
+	m->device_data = NULL;
+	return alsa_dev_close(dev);
+}
+
 const struct modem_driver alsa_driver = {
 	.name = "alsa",
 	.open = alsa_open,
@@ -524,4 +957,98 @@ const struct modem_driver alsa_driver = {
 	.read = alsa_read,
 	.write = alsa_write,
 	.ctrl = alsa_ctrl,
+	.mmap_begin = alsa_mmap_begin,
+	.mmap_commit = alsa_mmap_commit,
+};
+
+/*
+ * multichannel device: one line per channel
+ */
+
+static int alsa_group_open(struct dev_group *g, const char *dev_name)
+{
+	struct alsa_device *dev;
+	int ret;
+	ret = alsa_dev_open(&dev, dev_name, g->channels);
+	if (ret < 0)
+		return ret;
+	g->data = dev;
+	return ret;
+}
+
+static int alsa_group_close(struct dev_group *g)
+{
+	struct alsa_device *dev = g->data;
+	g->data = NULL;
+	return alsa_dev_close(dev);
+}
+
+static int alsa_group_start(struct dev_group *g)
+{
+	return alsa_dev_start(g->data);
+}
+
+static int alsa_group_stop(struct dev_group *g)
+{
+	return alsa_dev_stop(g->data);
+}
+
+static int alsa_group_read(struct dev_group *g, int16_t * frames,
+			   unsigned count)
+{
+	struct alsa_device *dev = g->data;
+	int ret = alsa_dev_read(dev, frames, count);
+	g->lost += dev->lost;
+	dev->lost = 0;
+	return ret;
+}
+
+static int alsa_group_write(struct dev_group *g, int16_t * frames,
+			    unsigned count)
+{
+	struct alsa_device *dev = g->data;
+	int ret = alsa_dev_write(dev, frames, count);
+	if (ret > 0)
+		alsa_measure(dev);
+	g->lost += dev->lost;
+	dev->lost = 0;
+	return ret;
+}
+
+static const struct dev_group_ops alsa_group_ops = {
+	.open = alsa_group_open,
+	.close = alsa_group_close,
+	.start = alsa_group_start,
+	.stop = alsa_group_stop,
+	.read = alsa_group_read,
+	.write = alsa_group_write,
+};
+
+static int alsa_line_open(struct modem *m, const char *dev_name)
+{
+	return dev_line_open(m, dev_name ? dev_name : modem_device_name,
+			     &alsa_group_ops);
+}
+
+/* no per line switches */
+static int alsa_line_ctrl(struct modem *m, unsigned int cmd,
+			  unsigned long arg)
+{
+	trace("cmd %u, arg %lu", cmd, arg);
+	if (cmd == MDRV_CTRL_DELAY)
+		return alsa_dev_delay(m->dev_group->data);
+	return 0;
+}
+
+const struct modem_driver alsa_multi_driver = {
+	.name = "alsa-multi",
+	.open = alsa_line_open,
+	.close = dev_line_close,
+	.start = dev_line_start,
+	.stop = dev_line_stop,
+	.read = dev_line_read,
+	.write = dev_line_write,
+	.ctrl = alsa_line_ctrl,
+	.mmap_begin = dev_line_mmap_begin,
+	.mmap_commit = dev_line_mmap_commit,
 };
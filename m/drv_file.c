@@ -74,18 +74,13 @@ static int file_ctrl(struct modem *m, unsigned cmd, unsigned long arg)
 	return 0;
 }
 
-static int file_open(struct modem *m, const char *dev_name)
+/* input is the file itself, output goes to 'name.out' */
+static int file_dev_open(struct file_device **pf, const char *file_name)
 {
 	char path[PATH_MAX];
 	struct file_device *f;
-	const char *file_name;
 	char *p;
 
-	trace();
-
-	file_name = dev_name;
-	if (!file_name)
-		file_name = modem_device_name;
 	f = malloc(sizeof(*f));
 	if (!f) {
 		err("no mem: %s\n", strerror(errno));
@@ -116,18 +111,36 @@ static int file_open(struct modem *m, const char *dev_name)
 			return -1;
 		}
 	}
-	m->device_data = f;
+	*pf = f;
 	return f->fd_in;
 }
 
+static void file_dev_close(struct file_device *f)
+{
+	close(f->fd_in);
+	close(f->fd_out);
+	free(f);
+}
+
+static int file_open(struct modem *m, const char *dev_name)
+{
+	struct file_device *f;
+	int ret;
+
+	trace();
+	ret = file_dev_open(&f, dev_name ? dev_name : modem_device_name);
+	if (ret < 0)
+		return ret;
+	m->device_data = f;
+	return ret;
+}
+
 static int file_close(struct modem *m)
 {
 	struct file_device *f = m->device_data;
 	trace();
 	m->device_data = NULL;
-	close(f->fd_in);
-	close(f->fd_out);
-	free(f);
+	file_dev_close(f);
 	return 0;
 }
 
@@ -141,3 +154,75 @@ const struct modem_driver file_driver = {
 	.write = file_write,
 	.ctrl = file_ctrl,
 };
+
+/*
+ * multichannel stand-in: interleaved raw file, one line per channel
+ */
+
+static int file_group_open(struct dev_group *g, const char *dev_name)
+{
+	struct file_device *f;
+	int ret;
+	ret = file_dev_open(&f, dev_name);
+	if (ret < 0)
+		return ret;
+	g->data = f;
+	return ret;
+}
+
+static int file_group_close(struct dev_group *g)
+{
+	struct file_device *f = g->data;
+	g->data = NULL;
+	file_dev_close(f);
+	return 0;
+}
+
+static int file_group_read(struct dev_group *g, int16_t * frames,
+			   unsigned count)
+{
+	struct file_device *f = g->data;
+	unsigned frame_size = g->channels * sizeof(int16_t);
+	int ret;
+	ret = read(f->fd_in, frames, count * frame_size);
+	if (ret <= 0)
+		return -1;	/* eof simulation */
+	return ret / frame_size;
+}
+
+static int file_group_write(struct dev_group *g, int16_t * frames,
+			    unsigned count)
+{
+	struct file_device *f = g->data;
+	unsigned frame_size = g->channels * sizeof(int16_t);
+	int ret;
+	ret = write(f->fd_out, frames, count * frame_size);
+	return ret < 0 ? ret : ret / frame_size;
+}
+
+static const struct dev_group_ops file_group_ops = {
+	.open = file_group_open,
+	.close = file_group_close,
+	.read = file_group_read,
+	.write = file_group_write,
+};
+
+static int file_line_open(struct modem *m, const char *dev_name)
+{
+	trace();
+	return dev_line_open(m, dev_name ? dev_name : modem_device_name,
+			     &file_group_ops);
+}
+
+const struct modem_driver file_multi_driver = {
+	.name = "file-multi",
+	.open = file_line_open,
+	.close = dev_line_close,
+	.start = dev_line_start,
+	.stop = dev_line_stop,
+	.read = dev_line_read,
+	.write = dev_line_write,
+	.ctrl = file_ctrl,
+	.mmap_begin = dev_line_mmap_begin,
+	.mmap_commit = dev_line_mmap_commit,
+};
@@ -0,0 +1,385 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+
+/*
+ *   drv_group.c - multichannel devices
+ *
+ *   Multiport cards expose their lines as channels of one PCM. Such a
+ *   device is opened once as a group and every modem gets one channel of it
+ *   as its 'line', named '<device>@<line>/<channels>'. The group is read and
+ *   written whole, one period at a time: fetch splits the interleaved
+ *   frames into per line buffers, lines process them in place through the
+ *   mmap ops, and the last line done merges and writes the period out.
+ *
+ *   Splitting and merging transposes 8x8 blocks of samples with vector
+ *   shuffles when channels and period allow, plain strided copies else.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "m.h"
+
+#define LINE_BIT(line) (1ULL << (line))
+
+typedef int16_t group_vec __attribute__ ((vector_size(8 * sizeof(int16_t)),
+					  aligned(2)));
+typedef int32_t group_vec32 __attribute__ ((vector_size(4 * sizeof(int32_t))));
+typedef int64_t group_vec64 __attribute__ ((vector_size(2 * sizeof(int64_t))));
+
+static struct dev_group *groups;
+
+/* rows of 8 samples with given strides, transposed */
+static void transpose8x8(int16_t * dst, unsigned dst_stride,
+			 const int16_t * src, unsigned src_stride)
+{
+	const group_vec lo16 = { 0, 8, 1, 9, 2, 10, 3, 11 };
+	const group_vec hi16 = { 4, 12, 5, 13, 6, 14, 7, 15 };
+	const group_vec32 lo32 = { 0, 4, 1, 5 }, hi32 = { 2, 6, 3, 7 };
+	const group_vec64 lo64 = { 0, 2 }, hi64 = { 1, 3 };
+	group_vec r[8], t[8];
+	group_vec32 u[8];
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = *(const group_vec *)(src + i * src_stride);
+	for (i = 0; i < 8; i += 2) {
+		t[i] = __builtin_shuffle(r[i], r[i + 1], lo16);
+		t[i + 1] = __builtin_shuffle(r[i], r[i + 1], hi16);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = __builtin_shuffle((group_vec32) t[i],
+					 (group_vec32) t[i + 2], lo32);
+		u[i + 1] = __builtin_shuffle((group_vec32) t[i],
+					     (group_vec32) t[i + 2], hi32);
+		u[i + 2] = __builtin_shuffle((group_vec32) t[i + 1],
+					     (group_vec32) t[i + 3], lo32);
+		u[i + 3] = __builtin_shuffle((group_vec32) t[i + 1],
+					     (group_vec32) t[i + 3], hi32);
+	}
+	for (i = 0; i < 4; i++) {
+		*(group_vec *)(dst + 2 * i * dst_stride) = (group_vec)
+		    __builtin_shuffle((group_vec64) u[i],
+				      (group_vec64) u[i + 4], lo64);
+		*(group_vec *)(dst + (2 * i + 1) * dst_stride) = (group_vec)
+		    __builtin_shuffle((group_vec64) u[i],
+				      (group_vec64) u[i + 4], hi64);
+	}
+}
+
+/* count x channels matrix to channels x count, rows of line are 'stride'
+ * apart */
+static void group_split(int16_t * lines, unsigned stride,
+			const int16_t * frames, unsigned channels,
+			unsigned count)
+{
+	unsigned i, c;
+
+	if (channels % 8 == 0 && count % 8 == 0) {
+		for (i = 0; i < count; i += 8)
+			for (c = 0; c < channels; c += 8)
+				transpose8x8(lines + c * stride + i, stride,
+					     frames + i * channels + c,
+					     channels);
+		return;
+	}
+	for (c = 0; c < channels; c++)
+		for (i = 0; i < count; i++)
+			lines[c * stride + i] = frames[i * channels + c];
+}
+
+static void group_merge(int16_t * frames, unsigned channels,
+			const int16_t * lines, unsigned stride,
+			unsigned count)
+{
+	unsigned i, c;
+
+	if (channels % 8 == 0 && count % 8 == 0) {
+		for (c = 0; c < channels; c += 8)
+			for (i = 0; i < count; i += 8)
+				transpose8x8(frames + i * channels + c,
+					     channels,
+					     lines + c * stride + i, stride);
+		return;
+	}
+	for (i = 0; i < count; i++)
+		for (c = 0; c < channels; c++)
+			frames[i * channels + c] = lines[c * stride + i];
+}
+
+static void group_flush(struct dev_group *g)
+{
+	int ret;
+	group_merge(g->frames, g->channels, g->out, DEV_BUF_SIZE, g->count);
+	ret = g->ops->write(g, g->frames, g->count);
+	if (ret < 0) {
+		err("group %s: write failed (%d)\n", g->name, ret);
+		g->error = ret;
+	}
+	__atomic_store_n(&g->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* reads next period and hands it to started lines; returns 0 while lines
+ * are still busy with the previous one, -EAGAIN when nothing was read */
+int dev_group_fetch(struct dev_group *g)
+{
+	uint64_t started;
+	int ret;
+
+	if (g->error)
+		return g->error;
+	if (__atomic_load_n(&g->busy, __ATOMIC_ACQUIRE))
+		return 0;
+	ret = g->ops->read(g, g->frames, DEV_BUF_SIZE);
+	if (ret <= 0) {
+		if (ret == 0 || ret == -EAGAIN)
+			return -EAGAIN;
+		dbg("group %s: read = %d\n", g->name, ret);
+		g->error = ret;
+		return ret;
+	}
+	g->count = ret;
+	group_split(g->in, DEV_BUF_SIZE, g->frames, g->channels, g->count);
+	memset(g->out, 0, g->channels * DEV_BUF_SIZE * sizeof(int16_t));
+
+	started = __atomic_load_n(&g->started, __ATOMIC_ACQUIRE);
+	if (g->lost) {
+		unsigned i;
+		for (i = 0; i < g->channels; i++)
+			if (started & LINE_BIT(i))
+				g->lines[i]->dev_lost += g->lost;
+		g->lost = 0;
+	}
+	if (!started) {
+		group_flush(g);
+		return g->error ? g->error : ret;
+	}
+	__atomic_store_n(&g->busy, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&g->due, started, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* the line is done with the period (or will not process it) */
+void dev_line_release(struct modem *m)
+{
+	struct dev_group *g = m->dev_group;
+	uint64_t bit = LINE_BIT(m->dev_line), old;
+
+	old = __atomic_fetch_and(&g->due, ~bit, __ATOMIC_ACQ_REL);
+	if (old == bit)
+		group_flush(g);
+}
+
+int dev_line_mmap_begin(struct modem *m, int16_t ** in, int16_t ** out,
+			unsigned int count, unsigned int more)
+{
+	struct dev_group *g = m->dev_group;
+
+	if (g->error)
+		return g->error;
+	if (!(__atomic_load_n(&g->due, __ATOMIC_ACQUIRE) &
+	      LINE_BIT(m->dev_line)))
+		return 0;
+	*in = g->in + m->dev_line * DEV_BUF_SIZE;
+	*out = g->out + m->dev_line * DEV_BUF_SIZE;
+	return count < g->count ? count : g->count;
+}
+
+int dev_line_mmap_commit(struct modem *m, unsigned int count)
+{
+	dev_line_release(m);
+	return 0;
+}
+
+/* lines are processed only via mmap ops */
+int dev_line_read(struct modem *m, void *buf, unsigned int count)
+{
+	return -ENOSYS;
+}
+
+int dev_line_write(struct modem *m, void *buf, unsigned int count)
+{
+	return -ENOSYS;
+}
+
+/* first started line starts the device, last stopped stops it */
+int dev_line_start(struct modem *m)
+{
+	struct dev_group *g = m->dev_group;
+	uint64_t bit = LINE_BIT(m->dev_line);
+	int ret;
+
+	trace("%s@%u", g->name, m->dev_line);
+	if (__atomic_fetch_or(&g->started, bit, __ATOMIC_ACQ_REL))
+		return 0;
+	if (g->ops->start && (ret = g->ops->start(g)) < 0) {
+		__atomic_and_fetch(&g->started, ~bit, __ATOMIC_ACQ_REL);
+		return ret;
+	}
+	return 0;
+}
+
+int dev_line_stop(struct modem *m)
+{
+	struct dev_group *g = m->dev_group;
+	uint64_t bit = LINE_BIT(m->dev_line);
+
+	trace("%s@%u", g->name, m->dev_line);
+	if (!(__atomic_fetch_and(&g->started, ~bit, __ATOMIC_ACQ_REL) & bit))
+		return 0;
+	dev_line_release(m);
+	if (!__atomic_load_n(&g->started, __ATOMIC_ACQUIRE) && g->ops->stop)
+		return g->ops->stop(g);
+	return 0;
+}
+
+static void group_free(struct dev_group *g)
+{
+	free(g->frames);
+	free(g->in);
+	free(g->out);
+	free(g);
+}
+
+static struct dev_group *group_get(const char *name,
+				   const struct dev_group_ops *ops,
+				   unsigned channels)
+{
+	struct dev_group *g;
+	unsigned size;
+
+	for (g = groups; g; g = g->next)
+		if (g->ops == ops && !strcmp(g->name, name)) {
+			if (channels && channels != g->channels) {
+				err("group %s has %u channels\n", g->name,
+				    g->channels);
+				return NULL;
+			}
+			return g;
+		}
+
+	if (!channels || channels > DEV_GROUP_MAX_LINES) {
+		err("bad channels number for %s: %u\n", name, channels);
+		return NULL;
+	}
+	g = malloc(sizeof(*g));
+	if (!g) {
+		err("no mem: %s\n", strerror(errno));
+		return NULL;
+	}
+	memset(g, 0, sizeof(*g));
+	snprintf(g->name, sizeof(g->name), "%s", name);
+	g->ops = ops;
+	g->channels = channels;
+	size = channels * DEV_BUF_SIZE * sizeof(int16_t);
+	g->frames = malloc(size);
+	g->in = malloc(size);
+	g->out = malloc(size);
+	if (!g->frames || !g->in || !g->out) {
+		err("no mem: %s\n", strerror(errno));
+		group_free(g);
+		return NULL;
+	}
+	g->fd = ops->open(g, g->name);
+	if (g->fd < 0) {
+		err("cannot open group %s\n", g->name);
+		group_free(g);
+		return NULL;
+	}
+	dbg("group %s: %u channels\n", g->name, g->channels);
+	g->next = groups;
+	groups = g;
+	return g;
+}
+
+static void group_put(struct dev_group *g)
+{
+	struct dev_group **p;
+	if (g->users)
+		return;
+	for (p = &groups; *p; p = &(*p)->next)
+		if (*p == g) {
+			*p = g->next;
+			break;
+		}
+	dbg("group %s: close\n", g->name);
+	g->ops->close(g);
+	group_free(g);
+}
+
+/* dev_name is '<device>@<line>/<channels>', channels may be omitted once
+ * the group is open */
+int dev_line_open(struct modem *m, const char *dev_name,
+		  const struct dev_group_ops *ops)
+{
+	char name[sizeof(((struct dev_group *) 0)->name)];
+	struct dev_group *g;
+	unsigned long line, channels = 0;
+	const char *p;
+	char *end;
+
+	trace("%s", dev_name);
+	p = strrchr(dev_name, '@');
+	if (!p || p == dev_name || p - dev_name >= sizeof(name)) {
+		err("bad line name \'%s\', should be <device>@<line>/<channels>\n",
+		    dev_name);
+		return -1;
+	}
+	memcpy(name, dev_name, p - dev_name);
+	name[p - dev_name] = '\0';
+	line = strtoul(p + 1, &end, 0);
+	if (end == p + 1 || (*end && *end != '/')) {
+		err("bad line number in \'%s\'\n", dev_name);
+		return -1;
+	}
+	if (*end == '/')
+		channels = strtoul(end + 1, NULL, 0);
+
+	g = group_get(name, ops, channels);
+	if (!g)
+		return -1;
+	if (line >= g->channels || g->lines[line]) {
+		err("line %lu of %s is %s\n", line, g->name,
+		    line >= g->channels ? "out of range" : "busy");
+		group_put(g);
+		return -1;
+	}
+	g->lines[line] = m;
+	g->users++;
+	m->dev_group = g;
+	m->dev_line = line;
+	return g->fd;
+}
+
+int dev_line_close(struct modem *m)
+{
+	struct dev_group *g = m->dev_group;
+
+	trace("%s@%u", g->name, m->dev_line);
+	g->lines[m->dev_line] = NULL;
+	g->users--;
+	m->dev_group = NULL;
+	group_put(g);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   dtmf.c - DTMF receiver datapump
+ *
+ *   Eight Goertzel filters, one per DTMF frequency, run as lanes of one
+ *   vector.  Two such banks run half a block apart, so there is a decision
+ *   each half block.  The strongest row and column tones are checked
+ *   against block energy, against each other (twist) and against other
+ *   tones of their groups.  A digit is reported once it is seen in two
+ *   decisions in a row, and again only after a gap or another digit; this
+ *   still takes 40 ms tones with 40 ms pauses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "m.h"
+#include "m_dsp.h"
+
+#define DTMF_SHIFT 6		/* input prescale */
+#define DTMF_BLOCK 204		/* bins are narrower than tones spacing */
+#define DTMF_STEP (DTMF_BLOCK / 2)
+#define DTMF_MIN_ENERGY 2000	/* squelch */
+/* twist limits: row tone may be up to 8 dB above column, 4 dB below */
+#define DTMF_TWIST_NORMAL(row, col) ((col) * 63 > (row) * 10)
+#define DTMF_TWIST_REVERSE(row, col) ((row) * 5 > (col) * 2)
+#define DTMF_OTHERS_SHIFT 3	/* others in group 9 dB below the peak */
+
+static const unsigned dtmf_freqs[8] = {
+	697, 770, 852, 941, 1209, 1336, 1477, 1633
+};
+
+static const char dtmf_digits[] = "123A456B789C*0#D";
+
+struct dtmf_struct {
+	struct modem *modem;
+	unsigned int num_samples;
+	unsigned int bank;	/* the older one */
+	int32_t energy[2];
+	tonedet_vec coeff;
+	tonedet_vec s1[2], s2[2];
+	char last;		/* previous decision */
+	char digit;		/* reported */
+};
+
+static char dtmf_decide(struct dtmf_struct *s, unsigned bank)
+{
+	int32_t energy = s->energy[bank];
+	int64_t te[8];
+	unsigned row = 0, col = 4, i;
+
+	for (i = 0; i < 8; i++) {
+		int64_t s1 = s->s1[bank][i], s2 = s->s2[bank][i];
+		te[i] = s1 * s1 + s2 * s2 -
+		    ((s->coeff[i] * s1 * s2) >> TONEDET_COEFF_SHIFT);
+	}
+	for (i = 1; i < 4; i++)
+		if (te[i] > te[row])
+			row = i;
+	for (i = 5; i < 8; i++)
+		if (te[i] > te[col])
+			col = i;
+
+	if (energy < DTMF_MIN_ENERGY)
+		return 0;
+	/* pure pair gives block * energy / 2, ask for a half of it */
+	if (4 * (te[row] + te[col]) < (int64_t) DTMF_BLOCK * energy)
+		return 0;
+	if (!DTMF_TWIST_NORMAL(te[row], te[col]) ||
+	    !DTMF_TWIST_REVERSE(te[row], te[col]))
+		return 0;
+	for (i = 0; i < 8; i++)
+		if (i != row && i != col &&
+		    te[i] << DTMF_OTHERS_SHIFT > te[i < 4 ? row : col])
+			return 0;
+	return dtmf_digits[row * 4 + col - 4];
+}
+
+static int dtmf_process(struct modem *m, int16_t * in, int16_t * out,
+			unsigned int count)
+{
+	struct dtmf_struct *s = (struct dtmf_struct *)m->datapump.dp;
+	unsigned int i, k, b;
+	char d;
+
+	for (i = 0; i < count; i++) {
+		int32_t sample = in[i] >> DTMF_SHIFT;
+		for (k = 0; k < 2; k++) {
+			tonedet_vec s0;
+			s->energy[k] += sample * sample;
+			s0 = sample + ((s->coeff * s->s1[k]) >>
+				       TONEDET_COEFF_SHIFT) - s->s2[k];
+			s->s2[k] = s->s1[k];
+			s->s1[k] = s0;
+		}
+		if (++s->num_samples < DTMF_STEP)
+			continue;
+		s->num_samples = 0;
+
+		/* the older bank has the whole block now */
+		b = s->bank;
+		d = dtmf_decide(s, b);
+		if (d == s->last && d != s->digit) {
+			s->digit = d;
+			if (d)
+				modem_update_dtmf(m, d);
+		}
+		s->last = d;
+
+		memset(&s->s1[b], 0, sizeof(s->s1[b]));
+		memset(&s->s2[b], 0, sizeof(s->s2[b]));
+		s->energy[b] = 0;
+		s->bank = b ^ 1;
+	}
+	memset(out, 0, count * sizeof(int16_t));
+	return count;
+}
+
+static void *dtmf_create(struct modem *m)
+{
+	struct dtmf_struct *s;
+	unsigned int i;
+	s = malloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	s->modem = m;
+	for (i = 0; i < arrsize(dtmf_freqs); i++)
+		s->coeff[i] = tonedet_coeff(dtmf_freqs[i]);
+	return s;
+}
+
+static void dtmf_delete(void *data)
+{
+	struct dtmf_struct *s = (struct dtmf_struct *)data;
+	free(s);
+}
+
+const struct dp_operations dtmf_ops = {
+	.create = dtmf_create,
+	.delete = dtmf_delete,
+	.process = dtmf_process,
+};
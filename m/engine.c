@@ -0,0 +1,1136 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   engine.c - drives many modems from one event loop
+ *
+ *   Without workers everything runs inline in the loop. With workers the
+ *   loop only dispatches: every modem belongs to a worker's shard, its fds
+ *   are armed with EPOLLONESHOT so only one thread processes a modem at a
+ *   time, and idle workers steal queued modems from busy ones.
+ *
+ *   In split (real-time) mode devices are moved to a separate sample
+ *   thread which does nothing but run periods through the datapumps. The
+ *   loop thread keeps ttys and control, the two sides talk through the
+ *   modem fifos and wake each other with eventfds.
+ *
+ *   Lines of a group device are not polled one by one: the group is, and
+ *   every period it reads is run through all its lines at once.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "m.h"
+
+#define ENGINE_MAX_EVENTS 64
+#define ENGINE_MAX_WORKERS 64
+#define ENGINE_TIMEOUT 1000	/* msecs */
+#define TTY_SUSPEND_LOOPS 100
+
+/* modem->engine_pending bits */
+#define PENDING_DEV    1
+#define PENDING_TTY    2
+#define PENDING_RESUME 4
+#define PENDING_RX     8	/* from sample thread: rx data or tx room */
+
+struct engine_poll {
+	int epfd;
+	unsigned int oneshot;
+	unsigned int always_ready;	/* armed sources which cannot be polled */
+};
+
+struct engine_worker {
+	struct modem_engine *engine;
+	pthread_t thread;
+	unsigned int id;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct modem *head, *tail;
+	unsigned int queued;
+	unsigned int idle;
+};
+
+struct modem_engine {
+	struct engine_poll ctl;
+	unsigned int loops;
+	unsigned int suspended;		/* suspended (closed) ttys */
+	unsigned int dead;		/* detached by workers, not reaped yet */
+	struct modem *modems;
+	struct dev_group *groups;
+	int ret;
+	/* worker pool */
+	unsigned int nr_workers;
+	unsigned int stop;
+	struct engine_worker *workers;
+	pthread_mutex_t lock;
+	/* real-time sample thread */
+	unsigned int rt;
+	int rt_priority;
+	int rt_cpu;
+	struct engine_poll rt_poll;
+	struct engine_src ctl_kick, rt_kick;
+	struct modem *rt_modems;
+	pthread_t rt_thread;
+};
+
+#define atomic_get(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_inc(p) __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_dec(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+
+/*
+ * event sources
+ */
+
+static void src_init(struct engine_src *src, struct engine_poll *poll,
+		     struct modem *m, int fd)
+{
+	memset(src, 0, sizeof(*src));
+	src->poll = poll;
+	src->modem = m;
+	src->fd = fd;
+}
+
+/* (re)arm the source; sources without events are removed from the epoll
+ * set, so hangups on idle ttys don't wake us up */
+static int src_arm(struct engine_src *src, unsigned int events)
+{
+	struct engine_poll *p = src->poll;
+	struct epoll_event ev;
+	int op;
+
+	if (src->always_ready) {
+		if (!src->events != !events) {
+			if (events)
+				atomic_inc(&p->always_ready);
+			else
+				atomic_dec(&p->always_ready);
+		}
+		src->events = events;
+		return 0;
+	}
+
+	/* oneshot sources are disarmed by every delivered event */
+	if (src->polled && src->events == events && (src->armed || !events))
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	if (p->oneshot)
+		ev.events |= EPOLLONESHOT;
+	ev.data.ptr = src;
+
+	if (!events)
+		op = src->polled ? EPOLL_CTL_DEL : -1;
+	else
+		op = src->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	if (op >= 0 && epoll_ctl(p->epfd, op, src->fd, &ev) < 0) {
+		if (op == EPOLL_CTL_ADD && errno == EPERM) {
+			/* regular files are always ready, as with poll() */
+			dbg("engine: fd %d is not pollable\n", src->fd);
+			src->always_ready = 1;
+			src->events = 0;
+			return src_arm(src, events);
+		}
+		err("epoll_ctl(%d) failed: %s\n", src->fd, strerror(errno));
+		return -1;
+	}
+
+	src->polled = (events != 0);
+	src->armed = (events != 0);
+	src->events = events;
+	return 0;
+}
+
+/*
+ * group devices
+ */
+
+/* with workers lines finish the period on any thread */
+static void group_lock(struct modem_engine *e)
+{
+	if (e->nr_workers)
+		pthread_mutex_lock(&e->lock);
+}
+
+static void group_unlock(struct modem_engine *e)
+{
+	if (e->nr_workers)
+		pthread_mutex_unlock(&e->lock);
+}
+
+/* polled while some line is started; when the period came while lines
+ * were busy with the previous one, the source is rearmed by the line which
+ * is done last */
+static int group_update(struct modem_engine *e, struct dev_group *g)
+{
+	int ret = 0;
+	group_lock(e);
+	if (!g->engine_wait || !atomic_get(&g->busy)) {
+		g->engine_wait = 0;
+		ret = src_arm(&g->src, atomic_get(&g->started) ? EPOLLIN : 0);
+	}
+	group_unlock(e);
+	return ret;
+}
+
+static void group_attach(struct modem_engine *e, struct dev_group *g)
+{
+	if (!g->engine) {
+		src_init(&g->src, e->rt ? &e->rt_poll : &e->ctl, NULL, g->fd);
+		g->src.group = g;
+		g->engine_wait = 0;
+		g->engine = e;
+		g->engine_next = e->groups;
+		e->groups = g;
+	}
+	atomic_inc(&g->engine_users);
+}
+
+static void group_unlink(struct modem_engine *e, struct dev_group *g)
+{
+	struct dev_group **p;
+	for (p = &e->groups; *p; p = &(*p)->engine_next)
+		if (*p == g) {
+			*p = g->engine_next;
+			break;
+		}
+	g->engine_next = NULL;
+	g->engine = NULL;
+}
+
+/* the sample thread owns group sources in split mode, unused ones are
+ * disarmed there and unlinked by groups_prune() */
+static void group_detach(struct modem_engine *e, struct dev_group *g)
+{
+	if (atomic_dec(&g->engine_users) || e->rt)
+		return;
+	group_lock(e);
+	src_arm(&g->src, 0);
+	group_unlock(e);
+	group_unlink(e, g);
+}
+
+static void groups_prune(struct modem_engine *e)
+{
+	struct dev_group *g, *next;
+	for (g = e->groups; g; g = next) {
+		next = g->engine_next;
+		if (!g->engine_users) {
+			src_arm(&g->src, 0);
+			group_unlink(e, g);
+		}
+	}
+}
+
+static int engine_update_dev(struct modem *m)
+{
+	if (m->dev_group)
+		return group_update(m->engine, m->dev_group);
+	return src_arm(&m->dev_src, m->started ? EPOLLIN : 0);
+}
+
+static int engine_update_tty(struct modem *m)
+{
+	unsigned tty_events = 0;
+	if (m->tty_src.suspended)
+		return src_arm(&m->tty_src, 0);
+	if (fifo_room(&m->tx_fifo))
+		tty_events = EPOLLIN;
+	if (m->tty_blocked)
+		tty_events |= EPOLLOUT;
+	return src_arm(&m->tty_src, tty_events);
+}
+
+/* the sample thread owns devices in split mode */
+static int engine_update(struct modem_engine *e, struct modem *m)
+{
+	if ((!e->rt && engine_update_dev(m) < 0) || engine_update_tty(m) < 0)
+		return -1;
+	return 0;
+}
+
+static void tty_suspend(struct modem_engine *e, struct modem *m)
+{
+	if (m->tty_src.suspended)
+		return;
+	dbg("engine: suspend tty %d\n", m->tty);
+	m->tty_src.suspended = 1;
+	atomic_inc(&e->suspended);
+}
+
+static void tty_resume(struct modem_engine *e, struct modem *m)
+{
+	if (!m->tty_src.suspended)
+		return;
+	m->tty_src.suspended = 0;
+	atomic_dec(&e->suspended);
+}
+
+/*
+ * modems list
+ */
+
+int modem_engine_add(struct modem_engine *e, struct modem *m)
+{
+	trace();
+	if (m->engine) {
+		err("modem is already attached\n");
+		return -1;
+	}
+	if (m->dev_group && m->dev_group->engine &&
+	    m->dev_group->engine != e) {
+		err("device group %s is attached to other engine\n",
+		    m->dev_group->name);
+		return -1;
+	}
+	src_init(&m->dev_src, e->rt ? &e->rt_poll : &e->ctl, m, m->dev);
+	src_init(&m->tty_src, &e->ctl, m, m->tty);
+	m->engine_pending = m->engine_queued = m->engine_dead = 0;
+	m->engine_rt = e->rt;
+	m->engine = e;
+	m->engine_next = e->modems;
+	e->modems = m;
+	if (e->rt) {
+		m->rt_next = e->rt_modems;
+		e->rt_modems = m;
+	}
+	if (m->dev_group)
+		group_attach(e, m->dev_group);
+	if (engine_update_dev(m) < 0 || engine_update_tty(m) < 0) {
+		modem_engine_remove(e, m);
+		return -1;
+	}
+	return 0;
+}
+
+static void engine_unlink(struct modem_engine *e, struct modem *m)
+{
+	struct modem **p;
+	for (p = &e->modems; *p; p = &(*p)->engine_next)
+		if (*p == m) {
+			*p = m->engine_next;
+			break;
+		}
+	if (m->dev_group)
+		group_detach(e, m->dev_group);
+	m->engine_next = NULL;
+	m->engine = NULL;
+	m->engine_rt = 0;
+}
+
+/* drops unlinked modems from the sample thread's list, when it is stopped */
+static void rt_list_prune(struct modem_engine *e)
+{
+	struct modem **p = &e->rt_modems;
+	while (*p)
+		if ((*p)->engine != e)
+			*p = (*p)->rt_next;
+		else
+			p = &(*p)->rt_next;
+}
+
+static void engine_set_ret(struct modem_engine *e, int ret)
+{
+	pthread_mutex_lock(&e->lock);
+	e->ret = ret;
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void engine_kick(struct engine_src *kick)
+{
+	uint64_t one = 1;
+	if (write(kick->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		dbg("engine: kick failed: %s\n", strerror(errno));
+}
+
+static void engine_mark_dead(struct modem_engine *e, struct modem *m)
+{
+	__atomic_store_n(&m->engine_dead, 1, __ATOMIC_RELEASE);
+	atomic_inc(&e->dead);
+}
+
+/* stop polling modem's fds; the list itself belongs to the loop thread,
+ * so with workers the modem is only marked and unlinked by engine_reap() */
+static void engine_detach(struct modem_engine *e, struct modem *m)
+{
+	if (e->rt) {
+		/* device belongs to the sample thread - ask it to finish */
+		src_arm(&m->tty_src, 0);
+		tty_resume(e, m);
+		if (!m->killed)
+			__atomic_store_n(&m->killed, SIGHUP, __ATOMIC_RELEASE);
+		if (!m->started)
+			engine_mark_dead(e, m);
+		return;
+	}
+	src_arm(&m->dev_src, 0);
+	src_arm(&m->tty_src, 0);
+	tty_resume(e, m);
+	if (m->dev_group)
+		dev_line_release(m);
+	if (!e->nr_workers) {
+		engine_unlink(e, m);
+		return;
+	}
+	engine_mark_dead(e, m);
+}
+
+static void engine_reap(struct modem_engine *e)
+{
+	struct modem *m, *next;
+	for (m = e->modems; m && atomic_get(&e->dead); m = next) {
+		next = m->engine_next;
+		if (atomic_get(&m->engine_dead)) {
+			src_arm(&m->tty_src, 0);
+			tty_resume(e, m);
+			engine_unlink(e, m);
+			atomic_dec(&e->dead);
+		}
+	}
+}
+
+void modem_engine_remove(struct modem_engine *e, struct modem *m)
+{
+	trace();
+	src_arm(&m->dev_src, 0);
+	src_arm(&m->tty_src, 0);
+	tty_resume(e, m);
+	if (m->engine_dead)
+		e->dead--;
+	m->engine_dead = 0;
+	engine_unlink(e, m);
+	rt_list_prune(e);
+	groups_prune(e);
+}
+
+/*
+ * modem processing
+ */
+
+static int engine_process(struct modem_engine *e, struct modem *m,
+			  unsigned int dev_events, unsigned int tty_events)
+{
+	int ret = 0;
+
+	if (dev_events && m->started) {
+		ret = modem_dev_process(m);
+		if (ret < 0)
+			goto _error;
+	}
+	/* once per period, or when tty is writable again */
+	if ((dev_events && !m->tty_blocked) || (tty_events && m->tty_blocked))
+		if (fifo_len(&m->rx_fifo))
+			modem_tty_flush(m);
+	if (tty_events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		ret = modem_tty_process(m);
+		if (ret < 0)
+			goto _error;
+		if (ret > 0)
+			tty_suspend(e, m);
+	}
+	if (m->killed) {
+		dbg("engine: modem is killed (%d)\n", m->killed);
+		goto _error;
+	}
+	if (engine_update(e, m) < 0) {
+		ret = -1;
+		goto _error;
+	}
+	return 0;
+
+_error:
+	engine_detach(e, m);
+	if (ret < 0)
+		engine_set_ret(e, ret);
+	return ret;
+}
+
+/* runs on a worker: handles everything pending for the modem */
+static void engine_work(struct modem_engine *e, struct modem *m)
+{
+	unsigned int pending;
+
+	for (;;) {
+		pending = __atomic_exchange_n(&m->engine_pending, 0,
+					      __ATOMIC_ACQ_REL);
+		if (!pending) {
+			__atomic_store_n(&m->engine_queued, 0, __ATOMIC_RELEASE);
+			/* recheck: the loop could add events meanwhile */
+			if (!atomic_get(&m->engine_pending) ||
+			    __atomic_exchange_n(&m->engine_queued, 1,
+						__ATOMIC_ACQ_REL))
+				break;
+			continue;
+		}
+		if (m->engine_dead)
+			continue;
+		if (pending & PENDING_DEV)
+			m->dev_src.armed = 0;
+		if (pending & PENDING_TTY)
+			m->tty_src.armed = 0;
+		if (pending & PENDING_RESUME)
+			tty_resume(e, m);
+		engine_process(e, m, (pending & PENDING_DEV) ? EPOLLIN : 0,
+			       (pending & PENDING_TTY) ? EPOLLIN : 0);
+	}
+}
+
+/*
+ * worker pool
+ */
+
+static void worker_enqueue(struct engine_worker *w, struct modem *m)
+{
+	m->work_next = NULL;
+	if (w->tail)
+		w->tail->work_next = m;
+	else
+		w->head = m;
+	w->tail = m;
+	w->queued++;
+}
+
+static struct modem *worker_dequeue(struct engine_worker *w)
+{
+	struct modem *m = w->head;
+	if (m) {
+		w->head = m->work_next;
+		if (!w->head)
+			w->tail = NULL;
+		w->queued--;
+	}
+	return m;
+}
+
+static struct modem *worker_steal(struct modem_engine *e,
+				  struct engine_worker *self)
+{
+	struct engine_worker *victim = NULL;
+	struct modem *m = NULL;
+	unsigned int i, max = 0;
+
+	for (i = 0; i < e->nr_workers; i++) {
+		struct engine_worker *w = &e->workers[i];
+		unsigned int queued = atomic_get(&w->queued);
+		if (w != self && queued > max) {
+			max = queued;
+			victim = w;
+		}
+	}
+	if (victim) {
+		pthread_mutex_lock(&victim->lock);
+		m = worker_dequeue(victim);
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return m;
+}
+
+static void engine_dispatch(struct modem_engine *e, struct modem *m,
+			    unsigned int bits)
+{
+	struct engine_worker *w;
+	unsigned int i, busy;
+
+	__atomic_or_fetch(&m->engine_pending, bits, __ATOMIC_RELEASE);
+	if (__atomic_exchange_n(&m->engine_queued, 1, __ATOMIC_ACQ_REL))
+		return;		/* queued or being processed already */
+
+	w = &e->workers[m->engine_shard];
+	pthread_mutex_lock(&w->lock);
+	worker_enqueue(w, m);
+	busy = !w->idle;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	if (!busy)
+		return;
+	/* owner is busy - wake somebody who can steal it */
+	for (i = 0; i < e->nr_workers; i++) {
+		struct engine_worker *idle = &e->workers[i];
+		if (idle == w || !atomic_get(&idle->idle))
+			continue;
+		pthread_mutex_lock(&idle->lock);
+		pthread_cond_signal(&idle->cond);
+		pthread_mutex_unlock(&idle->lock);
+		break;
+	}
+}
+
+static void engine_handle(struct modem_engine *e, struct modem *m,
+			  unsigned int dev_events, unsigned int tty_events)
+{
+	if (!e->nr_workers) {
+		engine_process(e, m, dev_events, tty_events);
+		return;
+	}
+	if (atomic_get(&m->engine_dead))
+		return;
+	engine_dispatch(e, m, (dev_events ? PENDING_DEV : 0) |
+			(tty_events ? PENDING_TTY : 0));
+}
+
+static void worker_pin(struct engine_worker *w)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	int ret;
+	if (ncpus <= 1)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(w->id % ncpus, &set);
+	ret = pthread_setaffinity_np(w->thread, sizeof(set), &set);
+	if (ret)
+		dbg("engine: cannot pin worker %u: %s\n", w->id, strerror(ret));
+}
+
+static void *worker_thread(void *arg)
+{
+	struct engine_worker *w = arg;
+	struct modem_engine *e = w->engine;
+	struct modem *m;
+
+	worker_pin(w);
+
+	pthread_mutex_lock(&w->lock);
+	while (!atomic_get(&e->stop)) {
+		m = worker_dequeue(w);
+		if (!m) {
+			pthread_mutex_unlock(&w->lock);
+			m = worker_steal(e, w);
+			pthread_mutex_lock(&w->lock);
+		}
+		if (!m) {
+			if (w->head || atomic_get(&e->stop))
+				continue;
+			__atomic_store_n(&w->idle, 1, __ATOMIC_RELEASE);
+			pthread_cond_wait(&w->cond, &w->lock);
+			__atomic_store_n(&w->idle, 0, __ATOMIC_RELEASE);
+			continue;
+		}
+		pthread_mutex_unlock(&w->lock);
+		engine_work(e, m);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void workers_stop(struct modem_engine *e, unsigned int count)
+{
+	unsigned int i;
+	__atomic_store_n(&e->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < count; i++) {
+		struct engine_worker *w = &e->workers[i];
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for (i = 0; i < count; i++)
+		pthread_join(e->workers[i].thread, NULL);
+}
+
+static int workers_start(struct modem_engine *e)
+{
+	struct modem *m;
+	unsigned int i;
+	int ret;
+
+	e->stop = 0;
+	for (m = e->modems, i = 0; m; m = m->engine_next, i++)
+		m->engine_shard = i % e->nr_workers;
+
+	for (i = 0; i < e->nr_workers; i++) {
+		struct engine_worker *w = &e->workers[i];
+		w->head = w->tail = NULL;
+		w->queued = w->idle = 0;
+		ret = pthread_create(&w->thread, NULL, worker_thread, w);
+		if (ret) {
+			err("cannot create worker %u: %s\n", i, strerror(ret));
+			workers_stop(e, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int modem_engine_set_workers(struct modem_engine *e, unsigned int nr)
+{
+	struct engine_worker *workers = NULL;
+	unsigned int i;
+
+	trace("%u", nr);
+	if (nr > ENGINE_MAX_WORKERS) {
+		err("too many workers: %u\n", nr);
+		return -1;
+	}
+	if (nr && e->rt) {
+		err("workers cannot be used with sample thread\n");
+		return -1;
+	}
+	if (e->modems) {
+		err("workers should be set before modems are added\n");
+		return -1;
+	}
+	if (nr) {
+		workers = malloc(nr * sizeof(*workers));
+		if (!workers) {
+			err("no mem: %s\n", strerror(errno));
+			return -1;
+		}
+		memset(workers, 0, nr * sizeof(*workers));
+		for (i = 0; i < nr; i++) {
+			workers[i].engine = e;
+			workers[i].id = i;
+			pthread_mutex_init(&workers[i].lock, NULL);
+			pthread_cond_init(&workers[i].cond, NULL);
+		}
+	}
+	for (i = 0; i < e->nr_workers; i++) {
+		pthread_mutex_destroy(&e->workers[i].lock);
+		pthread_cond_destroy(&e->workers[i].cond);
+	}
+	free(e->workers);
+	e->workers = workers;
+	e->nr_workers = nr;
+	e->ctl.oneshot = (nr != 0);
+	return 0;
+}
+
+/*
+ * real-time sample thread
+ */
+
+static void rt_detach(struct modem_engine *e, struct modem *m, int ret)
+{
+	dbg("engine: sample thread drops modem (%d, killed %d)\n",
+	    ret, m->killed);
+	src_arm(&m->dev_src, 0);
+	if (m->dev_group)
+		dev_line_release(m);
+	if (ret < 0)
+		engine_set_ret(e, ret);
+	engine_mark_dead(e, m);
+}
+
+/* returns nonzero when the loop thread should be kicked */
+static int rt_process(struct modem_engine *e, struct modem *m)
+{
+	unsigned int room = fifo_room(&m->tx_fifo);
+	int ret = 0;
+
+	if (m->started)
+		ret = modem_dev_process(m);
+	if (ret < 0 || atomic_get(&m->killed)) {
+		rt_detach(e, m, ret);
+		return 1;
+	}
+	if (engine_update_dev(m) < 0) {
+		rt_detach(e, m, -1);
+		return 1;
+	}
+	if (fifo_len(&m->rx_fifo) || (!room && fifo_room(&m->tx_fifo)))
+		return !(__atomic_fetch_or(&m->engine_pending, PENDING_RX,
+					   __ATOMIC_ACQ_REL) & PENDING_RX);
+	return 0;
+}
+
+/* the period is run through all lines of the group, from the loop or the
+ * sample thread; returns nonzero when the loop thread should be kicked */
+static int engine_group(struct modem_engine *e, struct dev_group *g, int rt)
+{
+	struct modem *m;
+	unsigned int i;
+	int ret, kick = 0;
+
+	if (!rt && e->ctl.oneshot) {
+		group_lock(e);
+		g->src.armed = 0;
+		group_unlock(e);
+	}
+	ret = dev_group_fetch(g);
+	if (ret == 0) {
+		/* lines are still busy */
+		group_lock(e);
+		g->engine_wait = 1;
+		group_unlock(e);
+		group_update(e, g);
+		return 0;
+	}
+	for (i = 0; ret != -EAGAIN && i < g->channels; i++) {
+		m = g->lines[i];
+		if (!m)
+			continue;
+		if (m->engine != e || atomic_get(&m->engine_dead) ||
+		    !m->started) {
+			dev_line_release(m);
+			continue;
+		}
+		if (rt)
+			kick |= rt_process(e, m);
+		else
+			engine_handle(e, m, EPOLLIN, 0);
+	}
+	if (rt && !atomic_get(&g->engine_users))
+		src_arm(&g->src, 0);
+	else
+		group_update(e, g);
+	return kick;
+}
+
+static void rt_setup(struct modem_engine *e)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int ret;
+
+	if (e->rt_priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = e->rt_priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret)
+			err("cannot set SCHED_FIFO priority %d: %s\n",
+			    e->rt_priority, strerror(ret));
+	}
+	if (e->rt_cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(e->rt_cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret)
+			err("cannot pin sample thread to cpu %d: %s\n",
+			    e->rt_cpu, strerror(ret));
+	}
+}
+
+static void *rt_thread(void *arg)
+{
+	struct modem_engine *e = arg;
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	struct dev_group *g;
+	struct modem *m;
+	uint64_t cnt;
+	int i, n, kick;
+
+	rt_setup(e);
+
+	while (!atomic_get(&e->stop)) {
+		n = epoll_wait(e->rt_poll.epfd, events, arrsize(events),
+			       atomic_get(&e->rt_poll.always_ready) ? 0 :
+			       ENGINE_TIMEOUT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err("epoll_wait error: %s\n", strerror(errno));
+			for (m = e->rt_modems; m; m = m->rt_next)
+				if (!atomic_get(&m->engine_dead))
+					rt_detach(e, m, -1);
+			engine_kick(&e->ctl_kick);
+			break;
+		}
+
+		kick = 0;
+		for (i = 0; i < n; i++) {
+			struct engine_src *src = events[i].data.ptr;
+			if (src == &e->rt_kick) {
+				/* only a wakeup, the count is dropped */
+				if (read(src->fd, &cnt, sizeof(cnt)) < 0 &&
+				    errno != EAGAIN)
+					dbg("rt kick read error: %s\n",
+					    strerror(errno));
+				continue;
+			}
+			if (src->group) {
+				kick |= engine_group(e, src->group, 1);
+				continue;
+			}
+			m = src->modem;
+			if (!atomic_get(&m->engine_dead))
+				kick |= rt_process(e, m);
+		}
+
+		if (atomic_get(&e->rt_poll.always_ready))
+			for (g = e->groups; g; g = g->engine_next)
+				if (g->src.always_ready && g->src.events)
+					kick |= engine_group(e, g, 1);
+
+		if (atomic_get(&e->rt_poll.always_ready))
+			for (m = e->rt_modems; m; m = m->rt_next)
+				if (!atomic_get(&m->engine_dead) &&
+				    m->dev_src.always_ready &&
+				    m->dev_src.events)
+					kick |= rt_process(e, m);
+
+		if (kick)
+			engine_kick(&e->ctl_kick);
+	}
+	return NULL;
+}
+
+/* loop thread: flush what the sample thread has received, rearm ttys */
+static void engine_kicked(struct modem_engine *e)
+{
+	struct modem *m;
+	uint64_t cnt;
+
+	if (read(e->ctl_kick.fd, &cnt, sizeof(cnt)) < 0)
+		return;
+	for (m = e->modems; m; m = m->engine_next) {
+		if (!atomic_get(&m->engine_pending) ||
+		    !(__atomic_exchange_n(&m->engine_pending, 0,
+					  __ATOMIC_ACQ_REL) & PENDING_RX) ||
+		    atomic_get(&m->engine_dead) || atomic_get(&m->killed))
+			continue;
+		if (!m->tty_blocked)
+			modem_tty_flush(m);
+		engine_update_tty(m);
+	}
+}
+
+static void rt_close(struct modem_engine *e)
+{
+	if (e->ctl_kick.fd >= 0) {
+		src_arm(&e->ctl_kick, 0);
+		close(e->ctl_kick.fd);
+	}
+	if (e->rt_kick.fd >= 0)
+		close(e->rt_kick.fd);
+	if (e->rt_poll.epfd >= 0)
+		close(e->rt_poll.epfd);
+	e->ctl_kick.fd = e->rt_kick.fd = e->rt_poll.epfd = -1;
+	e->rt = 0;
+}
+
+int modem_engine_set_rt(struct modem_engine *e, int priority, int cpu)
+{
+	trace("%d %d", priority, cpu);
+	if (e->nr_workers) {
+		err("sample thread cannot be used with workers\n");
+		return -1;
+	}
+	if (e->modems) {
+		err("sample thread should be set before modems are added\n");
+		return -1;
+	}
+	e->rt_priority = priority;
+	e->rt_cpu = cpu;
+	if (e->rt)
+		return 0;
+
+	e->rt_poll.epfd = epoll_create(ENGINE_MAX_EVENTS);
+	src_init(&e->ctl_kick, &e->ctl, NULL, eventfd(0, EFD_NONBLOCK));
+	src_init(&e->rt_kick, &e->rt_poll, NULL, eventfd(0, EFD_NONBLOCK));
+	if (e->rt_poll.epfd < 0 || e->ctl_kick.fd < 0 || e->rt_kick.fd < 0) {
+		err("cannot setup sample thread: %s\n", strerror(errno));
+		goto _error;
+	}
+	if (src_arm(&e->ctl_kick, EPOLLIN) < 0 ||
+	    src_arm(&e->rt_kick, EPOLLIN) < 0)
+		goto _error;
+	e->rt = 1;
+	return 0;
+_error:
+	rt_close(e);
+	return -1;
+}
+
+/*
+ * main loop
+ */
+
+static void engine_process_always_ready(struct modem_engine *e)
+{
+	struct dev_group *g, *gnext;
+	struct modem *m, *next;
+	for (g = e->groups; g && !e->rt; g = gnext) {
+		gnext = g->engine_next;
+		if (g->src.always_ready && g->src.events)
+			engine_group(e, g, 0);
+	}
+	for (m = e->modems; m && atomic_get(&e->ctl.always_ready); m = next) {
+		unsigned dev_events = 0, tty_events;
+		next = m->engine_next;
+		if (m->dev_src.always_ready && !e->rt)
+			dev_events = m->dev_src.events;
+		tty_events = m->tty_src.always_ready ? m->tty_src.events : 0;
+		if (dev_events || tty_events)
+			engine_handle(e, m, dev_events, tty_events);
+	}
+}
+
+static void tty_resume_all(struct modem_engine *e)
+{
+	struct modem *m;
+	for (m = e->modems; m && atomic_get(&e->suspended);
+	     m = m->engine_next) {
+		if (!atomic_get(&m->tty_src.suspended))
+			continue;
+		if (e->nr_workers) {
+			if (!atomic_get(&m->engine_dead))
+				engine_dispatch(e, m, PENDING_RESUME);
+			continue;
+		}
+		tty_resume(e, m);
+		engine_update(e, m);
+	}
+}
+
+int modem_engine_run(struct modem_engine *e)
+{
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	int i, n;
+
+	trace();
+
+	e->ret = 0;
+	if (e->nr_workers) {
+		struct dev_group *g;
+		struct modem *m;
+		/* rearm everything as oneshot */
+		for (g = e->groups; g; g = g->engine_next)
+			g->src.armed = 0;
+		for (m = e->modems; m; m = m->engine_next)
+			m->dev_src.armed = m->tty_src.armed = 0;
+		for (m = e->modems; m; m = m->engine_next)
+			engine_update(e, m);
+		if (workers_start(e) < 0)
+			return -1;
+	}
+	if (e->rt) {
+		int ret;
+		e->stop = 0;
+		ret = pthread_create(&e->rt_thread, NULL, rt_thread, e);
+		if (ret) {
+			err("cannot create sample thread: %s\n", strerror(ret));
+			return -1;
+		}
+	}
+
+	while (e->modems) {
+		if (modem_killed) {
+			struct modem *m;
+			for (m = e->modems; m; m = m->engine_next)
+				m->killed = modem_killed;
+			break;
+		}
+
+		n = epoll_wait(e->ctl.epfd, events, arrsize(events),
+			       atomic_get(&e->ctl.always_ready) ? 0 :
+			       ENGINE_TIMEOUT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err("epoll_wait error: %s\n", strerror(errno));
+			engine_set_ret(e, -1);
+			break;
+		}
+		e->loops++;
+
+		for (i = 0; i < n; i++) {
+			struct engine_src *src = events[i].data.ptr;
+			struct modem *m = src->modem;
+			if (src == &e->ctl_kick) {
+				engine_kicked(e);
+				continue;
+			}
+			if (src->group) {
+				if (src->group->engine == e)
+					engine_group(e, src->group, 0);
+				continue;
+			}
+			/* could be removed while processing previous events */
+			if (m->engine != e)
+				continue;
+			if (src == &m->dev_src)
+				engine_handle(e, m, events[i].events, 0);
+			else
+				engine_handle(e, m, 0, events[i].events);
+		}
+
+		if (atomic_get(&e->ctl.always_ready))
+			engine_process_always_ready(e);
+
+		if (atomic_get(&e->suspended) &&
+		    (n == 0 || e->loops % TTY_SUSPEND_LOOPS == 0))
+			tty_resume_all(e);
+
+		if (atomic_get(&e->dead))
+			engine_reap(e);
+	}
+
+	if (e->nr_workers) {
+		workers_stop(e, e->nr_workers);
+		engine_reap(e);
+	}
+	if (e->rt) {
+		__atomic_store_n(&e->stop, 1, __ATOMIC_RELEASE);
+		engine_kick(&e->rt_kick);
+		pthread_join(e->rt_thread, NULL);
+		engine_reap(e);
+		rt_list_prune(e);
+		groups_prune(e);
+	}
+
+	return e->ret;
+}
+
+struct modem_engine *modem_engine_create(void)
+{
+	struct modem_engine *e;
+
+	e = malloc(sizeof(*e));
+	if (!e) {
+		err("no mem: %s\n", strerror(errno));
+		return NULL;
+	}
+	memset(e, 0, sizeof(*e));
+	e->rt_poll.epfd = e->ctl_kick.fd = e->rt_kick.fd = -1;
+
+	e->ctl.epfd = epoll_create(ENGINE_MAX_EVENTS);
+	if (e->ctl.epfd < 0) {
+		err("epoll_create failed: %s\n", strerror(errno));
+		free(e);
+		return NULL;
+	}
+	pthread_mutex_init(&e->lock, NULL);
+	return e;
+}
+
+void modem_engine_delete(struct modem_engine *e)
+{
+	trace();
+	while (e->modems)
+		modem_engine_remove(e, e->modems);
+	modem_engine_set_workers(e, 0);
+	rt_close(e);
+	pthread_mutex_destroy(&e->lock);
+	close(e->ctl.epfd);
+	free(e);
+}
@@ -0,0 +1,158 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   fir.c - int16 FIR filters
+ *
+ *   History is kept twice, so the last 'size' samples are always
+ *   contiguous and the inner loop has no modulo. Taps are zero padded to
+ *   FIR_ALIGN, a kernel (scalar, SSE2 or AVX2) is chosen once by cpu
+ *   features. Sums are 32 bit and wrap the same way in every kernel, so
+ *   all of them are bit-exact with each other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "m_dsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FIR_X86 1
+#endif
+
+#define FIR_ALIGN 16		/* taps, one avx2 register */
+
+static int32_t fir_dot_scalar(const int16_t * x, const int16_t * h,
+			      unsigned len)
+{
+	int32_t sum = 0;
+	unsigned i;
+	for (i = 0; i < len; i++)
+		sum += x[i] * h[i];
+	return sum;
+}
+
+#ifdef FIR_X86
+__attribute__ ((target("sse2")))
+static int32_t fir_dot_sse2(const int16_t * x, const int16_t * h,
+			    unsigned len)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned i;
+	for (i = 0; i < len; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+		__m128i b = _mm_load_si128((const __m128i *)(h + i));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(a, b));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+	return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__ ((target("avx2")))
+static int32_t fir_dot_avx2(const int16_t * x, const int16_t * h,
+			    unsigned len)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+	unsigned i;
+	for (i = 0; i < len; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+		__m256i b = _mm256_load_si256((const __m256i *)(h + i));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+	}
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+			    _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+static int32_t(*fir_dot) (const int16_t *, const int16_t *, unsigned);
+static pthread_once_t fir_kernel_once = PTHREAD_ONCE_INIT;
+
+static void fir_select_kernel(void)
+{
+	const char *name = "scalar";
+	fir_dot = fir_dot_scalar;
+#ifdef FIR_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fir_dot = fir_dot_avx2;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		fir_dot = fir_dot_sse2;
+		name = "sse2";
+	}
+#endif
+	dbg("fir: using %s kernel\n", name);
+}
+
+int fir_init(struct fir *f, const int16_t * filter, unsigned size)
+{
+	unsigned len = (size + FIR_ALIGN - 1) / FIR_ALIGN * FIR_ALIGN;
+
+	pthread_once(&fir_kernel_once, fir_select_kernel);
+
+	memset(f, 0, sizeof(*f));
+	f->size = size;
+	f->len = len;
+	/* taps are aligned to the newest sample: leading ones are zero */
+	if (posix_memalign((void **)&f->taps, 32, len * sizeof(*f->taps)))
+		return -1;
+	memset(f->taps, 0, (len - size) * sizeof(*f->taps));
+	memcpy(f->taps + len - size, filter, size * sizeof(*f->taps));
+	f->history = calloc(2 * len, sizeof(*f->history));
+	if (!f->history) {
+		free(f->taps);
+		f->taps = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void fir_free(struct fir *f)
+{
+	free(f->taps);
+	free(f->history);
+	f->taps = f->history = NULL;
+}
+
+void fir_filter(struct fir *f, const int16_t * in, int16_t * out,
+		unsigned count)
+{
+	const unsigned len = f->len;
+	unsigned idx = f->index;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		f->history[idx] = f->history[idx + len] = in[i];
+		if (++idx == len)
+			idx = 0;
+		/* oldest..newest sample is history[idx..idx+len-1] */
+		out[i] = fir_dot(f->history + idx, f->taps, len) >> COSTAB_SHIFT;
+	}
+	f->index = idx;
+}
@@ -24,9 +24,36 @@
 
 #include "m_dsp.h"
 
+/*
+ * Demodulator: mark and space energies from correlations over the last
+ * filter_len samples.  Both tones sit on the sample grid, so their local
+ * oscillators repeat each 'period' samples and are tabled once, with one
+ * block more to never wrap inside a block.  Products of a whole block are
+ * done at once, then sums slide over them: a product leaving the window is
+ * the kept one, so sums stay exact.
+ */
+
+#ifdef MODEM_DEBUG
+/* fsk.data, with '-l 2' and up */
+static void fsk_log_tap(struct modem *m, const int32_t * diff_energy,
+			unsigned count)
+{
+	log_data(LOG_FSK_DATA, (void *)diff_energy,
+		 count * sizeof(*diff_energy));
+}
+#endif
+
+static unsigned fsk_period(unsigned freq)
+{
+	return SAMPLE_RATE / gcd(SAMPLE_RATE, freq);
+}
+
 int fsk_demodulator_init(struct fsk_demodulator *f, struct modem *m,
 			 unsigned freq0, unsigned freq1, unsigned bit_rate)
 {
+	unsigned p0 = fsk_period(freq0), p1 = fsk_period(freq1);
+	unsigned i;
+
 	memset(f, 0, sizeof(*f));
 	f->modem = m;
 	f->filter_len = SAMPLE_RATE / bit_rate < FSK_FILTER_LEN ?
@@ -36,117 +63,109 @@ int fsk_demodulator_init(struct fsk_demodulator *f, struct modem *m,
 		f->shift++;
 	f->shift = (15 - COSTAB_SHIFT > f->shift) ?
 	    0 : f->shift - (15 - COSTAB_SHIFT);
-	f->phinc0 = freq0 * COSTAB_SIZE / SAMPLE_RATE;
-	f->phinc1 = freq1 * COSTAB_SIZE / SAMPLE_RATE;
 	f->bit_rate = bit_rate;
-	f->bit_count = 0;
-	f->bit = 0;
-#ifdef FAST_FSK
-	f->phase0 = f->phase1 = 0;
-	f->x0 = f->y0 = f->x1 = f->y1 = 0;
+	f->period = p0 / gcd(p0, p1) * p1;
+	if (f->period > FSK_PERIOD_MAX) {
+		err("cannot demodulate %u/%u Hz\n", freq0, freq1);
+		return -1;
+	}
+	for (i = 0; i < f->period + FSK_BLOCK; i++) {
+		uint32_t ph0 = ((uint64_t) freq0 << 32) * i / SAMPLE_RATE +
+		    (1U << (NCO_SHIFT - 1));
+		uint32_t ph1 = ((uint64_t) freq1 << 32) * i / SAMPLE_RATE +
+		    (1U << (NCO_SHIFT - 1));
+		f->lo[i] = (fsk_vec) { nco_cos(ph0), nco_sin(ph0),
+			nco_cos(ph1), nco_sin(ph1) };
+	}
+#ifdef MODEM_DEBUG
+	if (log_level > 1)
+		f->tap = fsk_log_tap;
 #endif
-	f->hist_index = 0;
 	return 0;
 }
 
-int fsk_demodulate(struct fsk_demodulator *f, int16_t * buf, unsigned count)
+static void fsk_correlate(struct fsk_demodulator *f, const int16_t * buf,
+			  int32_t * diff_energy, unsigned count)
 {
+	const fsk_vec *lo = f->lo + f->lo_index;
 	const unsigned len = f->filter_len;
 	const unsigned shift = f->shift;
-	const unsigned phinc0 = f->phinc0;
-	const unsigned phinc1 = f->phinc1;
-	unsigned idx = f->hist_index;
-#ifdef FAST_FSK
-	unsigned ph0 = f->phase0;
-	unsigned ph1 = f->phase1;
-#endif
-	int32_t x0, y0, x1, y1, diff_energy;
-	unsigned bit;
-	unsigned int i;
+	fsk_vec *prod = f->prod;
+	fsk_vec sum = f->sum;
+	unsigned i;
+
+	/* independent of each other, compiler may take several at once */
+	for (i = 0; i < count; i++)
+		prod[len + i] = (buf[i] >> shift) * lo[i];
 
 	for (i = 0; i < count; i++) {
-#ifdef FAST_FSK
-		int16_t sample = f->history[idx % len];
-		f->x0 -= sample * m_cos(ph0 - phinc0 * len);
-		f->y0 -= sample * m_sin(ph0 - phinc0 * len);
-		f->x1 -= sample * m_cos(ph1 - phinc1 * len);
-		f->y1 -= sample * m_sin(ph1 - phinc1 * len);
-		sample = buf[i] >> shift;
-		f->x0 += sample * m_cos(ph0);
-		f->y0 += sample * m_sin(ph0);
-		f->x1 += sample * m_cos(ph1);
-		f->y1 += sample * m_sin(ph1);
-		f->history[idx % len] = sample;
-		idx++;
-		x0 = f->x0;
-		y0 = f->y0;
-		x1 = f->x1;
-		y1 = f->y1;
-		ph0 += phinc0;
-		ph1 += phinc1;
-#else
-		unsigned ph0, ph1;
-		unsigned j;
-		f->history[idx % len] = buf[i] >> shift;
-		idx++;
-		ph0 = ph1 = 0;
-		x0 = y0 = x1 = y1 = 0;
-		for (j = 0; j < len; j++) {
-			unsigned n = (idx + j) % len;
-			x0 += m_cos(ph0) * f->history[n];
-			y0 += m_sin(ph0) * f->history[n];
-			x1 += m_cos(ph1) * f->history[n];
-			y1 += m_sin(ph1) * f->history[n];
-			ph0 += phinc0;
-			ph1 += phinc1;
-		}
-#endif
-		x0 >>= COSTAB_SHIFT;
-		y0 >>= COSTAB_SHIFT;
-		x1 >>= COSTAB_SHIFT;
-		y1 >>= COSTAB_SHIFT;
+		fsk_vec e;
+		sum += prod[len + i] - prod[i];
+		e = sum >> COSTAB_SHIFT;
+		e *= e;
+		diff_energy[i] = e[2] + e[3] - e[0] - e[1];
+	}
+
+	memmove(prod, prod + count, len * sizeof(*prod));
+	f->sum = sum;
+	f->lo_index = (f->lo_index + count) % f->period;
+}
+
+static inline void fsk_put_bits(struct fsk_demodulator *f, unsigned bits,
+				unsigned num)
+{
+	if (f->put_bits)
+		f->put_bits(f->modem, bits, num);
+	else
+		modem_put_bits(f->modem, bits, num);
+}
+
+int fsk_demodulate(struct fsk_demodulator *f, int16_t * buf, unsigned count)
+{
+	int32_t diff_energy[FSK_BLOCK];
+	unsigned bit;
+	unsigned bits = 0, nbits = 0;	/* collected for modem_put_bits() */
+	unsigned int i, j, n;
 
-		diff_energy = x1 * x1 + y1 * y1 - x0 * x0 - y0 * y0;
+	for (i = 0; i < count; i += n) {
+		n = count - i < FSK_BLOCK ? count - i : FSK_BLOCK;
+		fsk_correlate(f, buf + i, diff_energy, n);
+		if (f->tap)
+			f->tap(f->modem, diff_energy, n);
 
+		for (j = 0; j < n; j++) {
 #ifdef CHECK_SIGNAL
 #define FSK_THRESHOLD 100000
-		if (m_abs(diff_energy) < FSK_THRESHOLD) {
-			no_signal_count++;
-			/* no signal */ ;
-			dbg();
-		} else
-			no_signal_count = 0;
+			if (m_abs(diff_energy[j]) < FSK_THRESHOLD) {
+				no_signal_count++;
+				/* no signal */ ;
+				dbg();
+			} else
+				no_signal_count = 0;
 #endif
-
-		bit = (diff_energy > 0);
-		f->bit_count += f->bit_rate;
-		if (f->bit != bit) {
-			/* 1: send bits: num = bit_count*bit_rate/SAMPLE_RATE */
-			if (f->bit_count > SAMPLE_RATE / 2) {
-				modem_put_bits(f->modem, f->bit, 1);
+			bit = (diff_energy[j] > 0);
+			f->bit_count += f->bit_rate;
+			if (f->bit != bit) {
+				/* 1: send bits: num = bit_count*bit_rate/SAMPLE_RATE */
+				if (f->bit_count > SAMPLE_RATE / 2) {
+					bits = (bits << 1) | f->bit;
+					nbits++;
+				}
+				f->bit = bit;
+				f->bit_count = 0;
+			} else if (f->bit_count >= SAMPLE_RATE) {
+				bits = (bits << 1) | f->bit;
+				nbits++;
+				f->bit_count -= SAMPLE_RATE;
+			}
+			if (nbits == ASYNC_MAX_BITS) {
+				fsk_put_bits(f, bits, nbits);
+				bits = nbits = 0;
 			}
-			f->bit = bit;
-			f->bit_count = 0;
-		} else if (f->bit_count >= SAMPLE_RATE) {
-			modem_put_bits(f->modem, f->bit, 1);
-			f->bit_count -= SAMPLE_RATE;
 		}
-#define BIG_LOG 1
-#ifdef BIG_LOG
-		enum { id_s1 = 16, id_s2, id_s3, id_s4 };
-#define LOG_VAL(s) { val = (s) ; log_data(id_##s, &(val), sizeof(val)); }
-		//dbg("%u: (mark %d.%d, space %d.%d) diff_energy = %d\n",
-		//              f->modem->samples_count+i,
-		//              x1,y1, x0,y0, diff_energy);
-		//{int16_t val;LOG_VAL(s1);LOG_VAL(s2);LOG_VAL(s3);LOG_VAL(s4);}
-		log_data(LOG_FSK_DATA, &diff_energy, sizeof(diff_energy));
-#endif
 	}
-#ifdef FAST_FSK
-	f->phase0 = ph0 % COSTAB_SIZE;
-	f->phase1 = ph1 % COSTAB_SIZE;
-#endif
-	f->hist_index = idx % len;
+	if (nbits)
+		fsk_put_bits(f, bits, nbits);
 	return i;
 }
 
@@ -156,32 +175,41 @@ int fsk_modulator_init(struct fsk_modulator *f, struct modem *m,
 	memset(f, 0, sizeof(*f));
 	f->modem = m;
 	f->bit_rate = bit_rate;
-	f->phinc0 = freq0 * COSTAB_SIZE / SAMPLE_RATE;
-	f->phinc1 = freq1 * COSTAB_SIZE / SAMPLE_RATE;
-	f->phinc = f->phinc1;
+	f->phinc0 = NCO_PHINC(freq0);
+	f->phinc1 = NCO_PHINC(freq1);
+	f->nco.phinc = f->phinc1;
 	return 0;
 }
 
 int fsk_modulate(struct fsk_modulator *f, int16_t * buf, unsigned count)
 {
-	unsigned int phinc = f->phinc;
-	unsigned int phase = f->phase;
 	unsigned int bit_count = f->bit_count;
 	unsigned int bit_rate = f->bit_rate;
-	int i;
-	for (i = 0; i < count; i++) {
-		buf[i] = m_sin(phase);
-		bit_count += bit_rate;
-		if (bit_count >= SAMPLE_RATE) {
-			unsigned bit = modem_get_bits(f->modem, 1);
-			//dbg("%d: getbit()...\n", bit_count);
-			bit_count -= SAMPLE_RATE;
-			phinc = bit ? f->phinc1 : f->phinc0;
+	unsigned int bits = 0, nbits = 0;
+	unsigned int i = 0, n;
+
+	while (i < count) {
+		/* samples till the next bit starts, this tone up to there */
+		n = (SAMPLE_RATE - bit_count + bit_rate - 1) / bit_rate;
+		if (n > count - i) {
+			nco_generate(&f->nco, buf + i, count - i);
+			bit_count += (count - i) * bit_rate;
+			break;
+		}
+		nco_generate(&f->nco, buf + i, n);
+		i += n;
+		bit_count += n * bit_rate - SAMPLE_RATE;
+		if (!nbits) {
+			/* exactly what is sent till the end of buf */
+			nbits = 1 + (bit_count + (count - i) * bit_rate) /
+			    SAMPLE_RATE;
+			if (nbits > ASYNC_MAX_BITS)
+				nbits = ASYNC_MAX_BITS;
+			bits = modem_get_bits(f->modem, nbits);
 		}
-		phase += phinc;
+		nbits--;
+		f->nco.phinc = (bits >> nbits) & 1 ? f->phinc1 : f->phinc0;
 	}
-	f->phase = phase % COSTAB_SIZE;
-	f->phinc = phinc;
 	f->bit_count = bit_count;
 	return count;
 }
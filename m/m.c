@@ -24,7 +24,9 @@
  *   m.c - 'm' means both "main" and "misc"
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "m.h"
 
@@ -37,14 +39,26 @@ const char *modem_device_name = "modem:1";
 const char *modem_tty_name = "/dev/ttyM";
 const char *modem_phone_number = "0123456789";
 const char *modulation_test = "detector";
+int modem_rt_priority = 0;
+int modem_rt_cpu = -1;
+int modem_workers = 0;
+int modem_lines = 0;
+int modem_cid_mode = 0;
+int tonedet_step = 16;
+int modem_latency = 0;
+int modem_drift = 0;
 
 /* drivers stuff */
 extern const struct modem_driver alsa_driver;
 extern const struct modem_driver file_driver;
+extern const struct modem_driver alsa_multi_driver;
+extern const struct modem_driver file_multi_driver;
 
 const static struct modem_driver *drivers[] = {
 	&alsa_driver,
 	&file_driver,
+	&alsa_multi_driver,
+	&file_multi_driver,
 };
 
 const struct signal_desc signal_descs[] = {
@@ -53,6 +67,10 @@ const struct signal_desc signal_descs[] = {
 	[SIGNAL_ANSAM] = {"Ansam", 2100},
 	[SIGNAL_2225] = {"2225", 2225},
 	[SIGNAL_2245] = {"2245", 2245},
+	[SIGNAL_DIALTONE] = {"dialtone", 350, 440},
+	[SIGNAL_BUSY] = {"busy", 480, 620, 500, 500},
+	[SIGNAL_REORDER] = {"reorder", 480, 620, 250, 250},
+	[SIGNAL_RINGBACK] = {"ringback", 440, 480, 2000, 4000},
 };
 
 const struct modem_driver *find_modem_driver(const char *name)
@@ -67,30 +85,58 @@ const struct modem_driver *find_modem_driver(const char *name)
 }
 
 /* fifo stuff */
+/* size is rounded up to power of two */
+int fifo_init(struct fifo *f, unsigned int size)
+{
+	unsigned int n = 1;
+	while (n < size)
+		n <<= 1;
+	memset(f, 0, sizeof(*f));
+	f->buf = malloc(n);
+	if (!f->buf) {
+		err("no mem for fifo: %s\n", strerror(errno));
+		return -1;
+	}
+	f->size = n;
+	f->mask = n - 1;
+	return 0;
+}
+
+void fifo_free(struct fifo *f)
+{
+	free(f->buf);
+	f->buf = NULL;
+	f->size = f->mask = 0;
+}
+
 unsigned int fifo_get(struct fifo *f, unsigned char *buf, unsigned int count)
 {
+	unsigned int head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = f->tail;
 	unsigned int cnt;
-	if (count > f->head - f->tail)
-		count = f->head - f->tail;
+	if (count > head - tail)
+		count = head - tail;
 	cnt = count;
-	if (cnt > sizeof(f->buf) - f->tail % sizeof(f->buf))
-		cnt = sizeof(f->buf) - f->tail % sizeof(f->buf);
-	memcpy(buf, f->buf + f->tail % sizeof(f->buf), cnt);
+	if (cnt > f->size - (tail & f->mask))
+		cnt = f->size - (tail & f->mask);
+	memcpy(buf, f->buf + (tail & f->mask), cnt);
 	memcpy(buf + cnt, f->buf, count - cnt);
-	f->tail += count;
+	__atomic_store_n(&f->tail, tail + count, __ATOMIC_RELEASE);
 	return count;
 }
 
 unsigned int fifo_put(struct fifo *f, unsigned char *buf, unsigned int count)
 {
+	unsigned int tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+	unsigned int head = f->head;
 	unsigned int cnt;
-	if (count > sizeof(f->buf) - (f->head - f->tail))
-		count = sizeof(f->buf) - (f->head - f->tail);
+	if (count > f->size - (head - tail))
+		count = f->size - (head - tail);
 	cnt = count;
-	if (cnt > sizeof(f->buf) - f->head % sizeof(f->buf))
-		cnt = sizeof(f->buf) - f->head % sizeof(f->buf);
-	memcpy(f->buf + f->head % sizeof(f->buf), buf, cnt);
+	if (cnt > f->size - (head & f->mask))
+		cnt = f->size - (head & f->mask);
+	memcpy(f->buf + (head & f->mask), buf, cnt);
 	memcpy(f->buf, buf + cnt, count - cnt);
-	f->head += count;
+	__atomic_store_n(&f->head, head + count, __ATOMIC_RELEASE);
 	return count;
 }
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <signal.h>
 #include <termios.h>
 
 #define SAMPLE_RATE 8000
@@ -38,6 +39,7 @@ enum MDRV_CTRL_CMD {
 	MDRV_CTRL_HOOK,
 	MDRV_CTRL_CID,
 	MDRV_CTRL_SPEAKER,
+	MDRV_CTRL_DELAY,	/* measured round trip delay, samples */
 };
 
 enum DP_ID {
@@ -46,6 +48,8 @@ enum DP_ID {
 	DP_DETECTOR,
 	DP_V21,
 	DP_V22,
+	DP_DTMF,
+	DP_CID,
 	DP_LAST,
 	DP_FAIL = 255
 };
@@ -58,6 +62,10 @@ enum SIGNAL_ID {
 	SIGNAL_2225,
 	SIGNAL_V21,
 	SIGNAL_V22,
+	SIGNAL_DIALTONE,
+	SIGNAL_BUSY,
+	SIGNAL_REORDER,
+	SIGNAL_RINGBACK,
 	SIGNAL_LAST,
 };
 
@@ -66,6 +74,7 @@ enum MODEM_STATUS {
 	STATUS_CONNECTING,
 	STATUS_DP_TIMEOUT,
 	STATUS_DP_CONNECT,
+	STATUS_BUSY,
 };
 
 struct modem;
@@ -73,7 +82,16 @@ struct modem;
 struct signal_desc {
 	const char *name;
 	unsigned freq;
-	/* add more stuff here */
+	unsigned freq2;		/* second tone of dual tone signals */
+	unsigned on, off;	/* cadence in ms, continuous if no off */
+};
+
+/* caller id, strings are empty when not received */
+struct cid_info {
+	char date[5];		/* MMDD */
+	char time[5];		/* HHMM */
+	char number[21];	/* or 'O' - unavailable, 'P' - private */
+	char name[51];		/* the same */
 };
 
 struct modem_driver {
@@ -85,6 +103,12 @@ struct modem_driver {
 	int (*read) (struct modem * m, void *buf, unsigned int count);
 	int (*write) (struct modem * m, void *buf, unsigned int count);
 	int (*ctrl) (struct modem * m, unsigned int cmd, unsigned long arg);
+	/* optional zero copy access: up to count samples to be processed in
+	 * place, -ENOSYS when the device cannot - read/write are used then;
+	 * more - not the first piece of the period, it is not waited for */
+	int (*mmap_begin) (struct modem * m, int16_t ** in, int16_t ** out,
+			   unsigned int count, unsigned int more);
+	int (*mmap_commit) (struct modem * m, unsigned int count);
 };
 
 struct dp_operations {
@@ -93,17 +117,86 @@ struct dp_operations {
 			unsigned count);
 	void (*hangup) (struct modem * m);
 	void (*delete) (void *dp_data);
-} *dp_op;
+};
 
 struct async_bitque {
 	unsigned int bits;
-	unsigned long data;
+	uint64_t data;
 };
 
+#define CACHELINE_SIZE 64
+#define FIFO_SIZE 4096
+
+/* single producer/single consumer ring, indices run freely and are
+ * masked on access; padding keeps each index in its own cache line */
 struct fifo {
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int mask;
+	char pad0[CACHELINE_SIZE];
 	unsigned int head;
+	char pad1[CACHELINE_SIZE - sizeof(unsigned int)];
 	unsigned int tail;
-	unsigned char buf[4096];
+	char pad2[CACHELINE_SIZE - sizeof(unsigned int)];
+};
+
+struct modem_engine;
+struct engine_poll;
+struct dev_group;
+
+/* device or tty fd as seen by engine */
+struct engine_src {
+	struct engine_poll *poll;
+	struct modem *modem;
+	struct dev_group *group;	/* or whole group device */
+	int fd;
+	unsigned int events;
+	unsigned int polled;
+	unsigned int armed;
+	unsigned int always_ready;
+	unsigned int suspended;
+};
+
+#define DEV_BUF_SIZE PERIOD_SIZE
+
+#define DEV_GROUP_MAX_LINES 64
+
+/* multichannel device, one channel ('line') per modem; drivers provide
+ * interleaved i/o, lines are split and merged here */
+struct dev_group_ops {
+	int (*open) (struct dev_group * g, const char *dev_name);
+	int (*close) (struct dev_group * g);
+	int (*start) (struct dev_group * g);
+	int (*stop) (struct dev_group * g);
+	int (*read) (struct dev_group * g, int16_t * frames, unsigned count);
+	int (*write) (struct dev_group * g, int16_t * frames, unsigned count);
+};
+
+struct dev_group {
+	struct dev_group *next;
+	char name[64];
+	const struct dev_group_ops *ops;
+	void *data;
+	int fd;
+	unsigned int channels;
+	unsigned int users;
+	struct modem *lines[DEV_GROUP_MAX_LINES];
+	uint64_t started;	/* lines mask */
+	/* the period in work: fetch hands it to started lines, the last one
+	 * done writes it out */
+	uint64_t due;
+	unsigned int busy;
+	unsigned int count;
+	unsigned int lost;	/* by device xrun, for every line */
+	int error;
+	int16_t *frames;	/* interleaved */
+	int16_t *in, *out;	/* DEV_BUF_SIZE per line */
+	/* engine stuff */
+	struct modem_engine *engine;
+	struct dev_group *engine_next;
+	struct engine_src src;
+	unsigned int engine_users;
+	unsigned int engine_wait;
 };
 
 struct modem {
@@ -143,8 +236,27 @@ struct modem {
 	} datapump;
 	struct async_bitque rx_bitque, tx_bitque;
 	struct fifo rx_fifo, tx_fifo;
+	unsigned int tty_blocked;	/* rx_fifo waits for tty to drain */
+	unsigned int rx_dropped;
 	unsigned char sregs[16];
 	char dial_string[128];
+	/* engine stuff */
+	struct modem_engine *engine;
+	struct modem *engine_next;
+	struct engine_src dev_src, tty_src;
+	/* line of a group device, polled as the whole group */
+	struct dev_group *dev_group;
+	unsigned int dev_line;
+	/* samples the device has lost (xrun), to be run as silence */
+	unsigned int dev_lost;
+	unsigned int engine_shard;
+	unsigned int engine_pending;
+	unsigned int engine_queued;
+	unsigned int engine_dead;
+	unsigned int engine_rt;
+	struct modem *work_next;
+	struct modem *rt_next;
+	int16_t dev_buf_in[DEV_BUF_SIZE], dev_buf_out[DEV_BUF_SIZE];
 };
 
 /*
@@ -156,11 +268,52 @@ static inline void fifo_reset(struct fifo *f)
 	f->head = f->tail = 0;
 }
 
+/* producer owns head, consumer owns tail: own index is read plainly, the
+ * other one with acquire, and publishing is done with release */
+static inline unsigned fifo_len(struct fifo *f)
+{
+	return __atomic_load_n(&f->head, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+}
+
 static inline unsigned fifo_room(struct fifo *f)
 {
-	return sizeof(f->buf) - (f->head - f->tail);
+	return f->size - fifo_len(f);
 }
 
+/* zero copy producer: contiguous free space, then commit what is filled */
+static inline unsigned fifo_reserve(struct fifo *f, unsigned char **ptr)
+{
+	unsigned head = f->head;
+	unsigned room = f->size - (head - __atomic_load_n(&f->tail,
+							 __ATOMIC_ACQUIRE));
+	unsigned cnt = f->size - (head & f->mask);
+	*ptr = f->buf + (head & f->mask);
+	return room < cnt ? room : cnt;
+}
+
+static inline void fifo_commit(struct fifo *f, unsigned count)
+{
+	__atomic_store_n(&f->head, f->head + count, __ATOMIC_RELEASE);
+}
+
+/* zero copy consumer: contiguous data, then consume what is used */
+static inline unsigned fifo_peek(struct fifo *f, unsigned char **ptr)
+{
+	unsigned tail = f->tail;
+	unsigned len = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE) - tail;
+	unsigned cnt = f->size - (tail & f->mask);
+	*ptr = f->buf + (tail & f->mask);
+	return len < cnt ? len : cnt;
+}
+
+static inline void fifo_consume(struct fifo *f, unsigned count)
+{
+	__atomic_store_n(&f->tail, f->tail + count, __ATOMIC_RELEASE);
+}
+
+extern int fifo_init(struct fifo *f, unsigned size);
+extern void fifo_free(struct fifo *f);
 extern unsigned fifo_get(struct fifo *f, unsigned char *buf, unsigned count);
 extern unsigned fifo_put(struct fifo *f, unsigned char *buf, unsigned count);
 
@@ -173,20 +326,35 @@ extern void async_bitque_put_bits(struct modem *m, unsigned bits, unsigned num);
 extern unsigned async_bitque_get_bits(struct modem *m, unsigned num);
 
 extern struct modem *modem_create(const char *tty_name, const char *drv_name);
+extern struct modem *modem_create_dev(const char *tty_name,
+				      const char *drv_name,
+				      const char *dev_name);
 extern void modem_delete(struct modem *m);
 extern int modem_go(struct modem *m, enum DP_ID dp_id);
 extern int modem_dial(struct modem *m, const char *dial_string);
+extern int modem_cid(struct modem *m);
 extern int modem_run(struct modem *m);
+extern int modem_run_all(struct modem **modems, unsigned int count);
+extern int modem_dev_process(struct modem *m);
+extern int modem_tty_process(struct modem *m);
+extern int modem_tty_flush(struct modem *m);
 extern int modem_process(struct modem *m, int16_t * in, int16_t * out,
 			 unsigned int count);
 extern int modem_set_hook(struct modem *m, unsigned int hook_off);
 
 extern void modem_update_status(struct modem *m, enum MODEM_STATUS status);
 extern void modem_update_signals(struct modem *m, unsigned int signals);
+extern void modem_update_dtmf(struct modem *m, char digit);
+extern void modem_update_cid(struct modem *m, const struct cid_info *cid);
+
+/* bits are passed msb (first on line) first, up to ASYNC_MAX_BITS per call;
+ * datapumps should collect them and pass whole spans */
+#define ASYNC_MAX_BITS 32
+#define bits_mask(num) ((num) >= 32 ? ~0U : (1U << (num)) - 1)
 
 static inline unsigned modem_get_bits(struct modem *m, unsigned num)
 {
-	return m->get_bits ? m->get_bits(m, num) : ((1 << num) - 1);
+	return m->get_bits ? m->get_bits(m, num) : bits_mask(num);
 }
 
 static inline void modem_put_bits(struct modem *m, unsigned bits, unsigned num)
@@ -195,6 +363,29 @@ static inline void modem_put_bits(struct modem *m, unsigned bits, unsigned num)
 		m->put_bits(m, bits, num);
 }
 
+/* group devices */
+extern int dev_line_open(struct modem *m, const char *dev_name,
+			 const struct dev_group_ops *ops);
+extern int dev_line_close(struct modem *m);
+extern int dev_line_start(struct modem *m);
+extern int dev_line_stop(struct modem *m);
+extern int dev_line_read(struct modem *m, void *buf, unsigned int count);
+extern int dev_line_write(struct modem *m, void *buf, unsigned int count);
+extern int dev_line_mmap_begin(struct modem *m, int16_t ** in, int16_t ** out,
+			       unsigned int count, unsigned int more);
+extern int dev_line_mmap_commit(struct modem *m, unsigned int count);
+extern void dev_line_release(struct modem *m);
+extern int dev_group_fetch(struct dev_group *g);
+
+/* multi-modem engine */
+extern struct modem_engine *modem_engine_create(void);
+extern void modem_engine_delete(struct modem_engine *e);
+extern int modem_engine_add(struct modem_engine *e, struct modem *m);
+extern void modem_engine_remove(struct modem_engine *e, struct modem *m);
+extern int modem_engine_run(struct modem_engine *e);
+extern int modem_engine_set_workers(struct modem_engine *e, unsigned int nr);
+extern int modem_engine_set_rt(struct modem_engine *e, int priority, int cpu);
+
 /* modem drivers interface */
 extern const struct modem_driver *find_modem_driver(const char *name);
 extern const struct dp_operations *find_dp_operations(unsigned int id);
@@ -208,6 +399,8 @@ extern int parse_cmdline(int argc, char **argv);
 
 extern const struct signal_desc signal_descs[SIGNAL_LAST];
 
+extern volatile sig_atomic_t modem_killed;
+
 extern unsigned int verbose_level;
 extern unsigned int debug_level;
 extern unsigned int log_level;
@@ -216,6 +409,14 @@ extern const char *modem_device_name;
 extern const char *modem_tty_name;
 extern const char *modem_phone_number;
 extern const char *modulation_test;
+extern int modem_rt_priority;
+extern int modem_rt_cpu;
+extern int modem_workers;
+extern int modem_lines;
+extern int modem_cid_mode;
+extern int tonedet_step;
+extern int modem_latency;
+extern int modem_drift;
 
 /*
  * misc helpers
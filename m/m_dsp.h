@@ -28,40 +28,88 @@
 #include "m.h"
 #include "m_tables.h"
 
-#define m_cos(x) ((costab)[(x)%(COSTAB_SIZE)])
+#define m_cos(x) ((costab)[(x)&((COSTAB_SIZE)-1)])
 #define m_sin(x) (m_cos((x)+(COSTAB_SIZE)*3/4))
 
 #define m_abs(x) ((x) < 0 ? -(x) : (x))
 
+static inline unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * NCO stuff
+ */
+
+/* 32 bit phase: full turn is 2^32, top bits index costab */
+#define NCO_SHIFT (32 - __builtin_ctz(COSTAB_SIZE))
+#define NCO_PHINC(freq) ((uint32_t)(((uint64_t)(freq) << 32) / SAMPLE_RATE))
+#define NCO_QUARTER (1U << 30)
+
+struct nco {
+	uint32_t phase;
+	uint32_t phinc;
+};
+
+static inline int16_t nco_cos(uint32_t phase)
+{
+	return costab[phase >> NCO_SHIFT];
+}
+
+static inline int16_t nco_sin(uint32_t phase)
+{
+	return costab[(phase - NCO_QUARTER) >> NCO_SHIFT];
+}
+
+static inline void nco_init(struct nco *n, unsigned freq)
+{
+	n->phase = 0;
+	n->phinc = NCO_PHINC(freq);
+}
+
+/* sine wave blocks */
+extern void nco_generate(struct nco *n, int16_t * buf, unsigned count);
+
 /*
  * FSK stuff
  */
 
 #define FSK_FILTER_LEN 40
+#define FSK_BLOCK 64		/* samples correlated at once */
+#define FSK_PERIOD_MAX 400	/* longest period of both tones, V.21 one */
 
-#define FAST_FSK 1
+/* cos0, sin0, cos1, sin1 lanes */
+typedef int32_t fsk_vec __attribute__ ((vector_size(4 * sizeof(int32_t))));
 
 struct fsk_demodulator {
 	struct modem *modem;
 	unsigned filter_len;
 	unsigned int shift;
-	unsigned int phinc0;
-	unsigned int phinc1;
 	unsigned int bit_rate;
 	unsigned int bit;
 	unsigned int bit_count;
-#ifdef FAST_FSK
-	unsigned int phase0;
-	unsigned int phase1;
-	int32_t x0, y0, x1, y1;
-#endif
-	unsigned hist_index;
-	int16_t history[FSK_FILTER_LEN];
+	unsigned int period;
+	unsigned int lo_index;
+	fsk_vec sum;
+	/* bits go here when set, to the modem otherwise */
+	void (*put_bits) (struct modem * m, unsigned bits, unsigned num);
+	/* opt-in per sample (mark - space) energy output */
+	void (*tap) (struct modem * m, const int32_t * diff_energy,
+		     unsigned count);
+	/* last filter_len products are kept ahead of the block */
+	fsk_vec prod[FSK_FILTER_LEN + FSK_BLOCK];
+	/* local oscillators over the period, then a block more of them */
+	fsk_vec lo[FSK_PERIOD_MAX + FSK_BLOCK];
 };
 
 struct fsk_modulator {
-	unsigned int phase;
-	unsigned int phinc;
+	struct nco nco;
 	unsigned int bit_rate;
 	unsigned int bit_count;
 	unsigned int phinc0, phinc1;
@@ -82,37 +130,167 @@ extern int fsk_modulate(struct fsk_modulator *f, int16_t * buf, unsigned count);
  * PSK stuff
  */
 
-#define PSK_FILTER_LEN 256
+/* receiver runs at baseband, matched filter is evaluated at strobes only */
+#define PSK_DEM_PHASES 4
+#define PSK_DEM_LEN 48
+#define PSK_DEM_HIST 64
 
 struct psk_demodulator {
-	unsigned int shift;
-	unsigned filter_len;
-	unsigned int phinc;
+	uint32_t phinc;
+	uint32_t phase;
+	const int16_t *shape;
+	unsigned int phases;
+	unsigned int len;
 	unsigned hist_index;
-	int16_t history[PSK_FILTER_LEN];
-	unsigned int symbol;
+	int16_t history_x[2 * PSK_DEM_HIST];
+	int16_t history_y[2 * PSK_DEM_HIST];
+	int64_t clock;		/* timing NCO, wraps at strobes */
+	uint32_t step;
+	int32_t clock_adj;
+	unsigned int strobe;
+	int32_t x, y;		/* last on-time sample */
+	int32_t mid_x, mid_y;
 	unsigned int symbol_rate;
-	unsigned int symbol_count;
 	struct modem *modem;
 	void (*put_symbol) (struct modem * m, unsigned symbol);
 };
 
+/* transmitter is symbol driven: every symbol adds its precomputed shaped
+ * and modulated response into the output ring */
+#define PSK_MOD_PHASES 4
+#define PSK_MOD_LEN 48
+#define PSK_MOD_RING 64
+
 struct psk_modulator {
-	unsigned int phase;
-	unsigned int phinc;
+	unsigned int quadrant;
 	unsigned int symbol_rate;
 	unsigned int symbol_count;
+	unsigned int phases;
+	unsigned int len;
+	unsigned int index;
+	int32_t ring[2 * PSK_MOD_RING];
+	int16_t resp[PSK_MOD_PHASES][4][PSK_MOD_LEN];
 	struct modem *modem;
 	unsigned int (*get_symbol) (struct modem * m);
 };
 
 extern int psk_demodulator_init(struct psk_demodulator *p, struct modem *m,
-				unsigned freq, unsigned symbol_rate);
+				unsigned freq, unsigned symbol_rate,
+				const int16_t * shape, unsigned shape_size);
 extern int psk_demodulate(struct psk_demodulator *p, int16_t * buf,
 			  unsigned int count);
 extern int psk_modulator_init(struct psk_modulator *p, struct modem *m,
-			      unsigned freq, unsigned symbol_rate);
+			      unsigned freq, unsigned symbol_rate,
+			      const int16_t * shape, unsigned shape_size);
 extern int psk_modulate(struct psk_modulator *p, int16_t * buf,
 			unsigned int count);
 
+/*
+ * FIR stuff
+ */
+
+struct fir {
+	unsigned size;		/* filter taps */
+	unsigned len;		/* padded */
+	unsigned index;
+	int16_t *taps;
+	int16_t *history;	/* 2 * len: doubled */
+};
+
+extern int fir_init(struct fir *f, const int16_t * filter, unsigned size);
+extern void fir_free(struct fir *f);
+extern void fir_filter(struct fir *f, const int16_t * in, int16_t * out,
+		       unsigned count);
+
+/*
+ * fractional resampler
+ */
+
+#define RESAMPLE_ONE (1ULL << 32)	/* step for the same rate */
+
+struct resampler {
+	uint64_t pos;		/* next output in buf, 32.32 */
+	uint64_t step;		/* input samples per output, 32.32 */
+	unsigned len;		/* samples in buf */
+	unsigned size;
+	int16_t *buf;		/* history and not consumed input */
+};
+
+extern int resampler_init(struct resampler *r, unsigned count);
+extern void resampler_free(struct resampler *r);
+extern void resampler_reset(struct resampler *r);
+extern unsigned resample(struct resampler *r, const int16_t * in,
+			 unsigned count, int16_t * out, unsigned max);
+
+/*
+ * tone detector stuff
+ */
+
+#define TONEDET_MAX 8
+#define TONEDET_WINDOW 256
+#define TONEDET_COEFF_SHIFT 12	/* Goertzel 2cos(w) is kept in Q12 */
+
+/* malloc() gives only 16 byte alignment, unaligned access is fine here */
+typedef int32_t tonedet_vec
+    __attribute__ ((vector_size(TONEDET_MAX * sizeof(int32_t)), aligned(16)));
+typedef uint32_t tonedet_uvec
+    __attribute__ ((vector_size(TONEDET_MAX * sizeof(uint32_t)), aligned(16)));
+
+/* signal from signal_descs[], made of one or two tones */
+struct tonedet_signal {
+	unsigned int mask;
+	unsigned int on, off;	/* cadence in samples, no off - continuous */
+	unsigned int present;
+	unsigned int detected;
+	unsigned int time;	/* since last on/off edge */
+	unsigned int last_on;
+};
+
+struct tonedet {
+	unsigned int step;	/* decision interval, 0 - block mode */
+	unsigned int min_on;	/* for continuous signals */
+	unsigned int num_samples;
+	unsigned int hist_index;
+	int32_t energy;
+	int32_t noise_floor;
+	unsigned int tones_on;
+	unsigned int detected;	/* signals mask */
+	/* tones, one per frequency, are vector lanes */
+	unsigned int num;
+	unsigned int freq[TONEDET_MAX];
+	unsigned int mask[TONEDET_MAX];
+	tonedet_vec coeff;
+	tonedet_vec s1, s2;
+	tonedet_uvec phase, phinc;
+	tonedet_vec x, y;
+	unsigned int num_signals;
+	struct tonedet_signal signals[TONEDET_MAX];
+	int32_t hist_energy[TONEDET_WINDOW];
+	tonedet_vec hist_x[TONEDET_WINDOW], hist_y[TONEDET_WINDOW];
+};
+
+extern int32_t tonedet_coeff(unsigned freq);
+extern void tonedet_init(struct tonedet *t, unsigned step, unsigned min_on);
+extern int tonedet_add_signal(struct tonedet *t, unsigned id);
+/* stops after 'detected' changes, returns samples processed */
+extern unsigned tonedet_process(struct tonedet *t, int16_t * buf,
+				unsigned count);
+
+/*
+ * scrambler stuff
+ */
+
+struct scrambler {
+	uint64_t data;
+	unsigned int one_count;
+};
+
+extern unsigned scramble_bit(struct scrambler *s, unsigned bit);
+extern unsigned descramble_bit(struct scrambler *s, unsigned bit);
+/* up to 32 bits, msb first */
+extern unsigned scramble_bits(struct scrambler *s, unsigned bits,
+			      unsigned num);
+extern unsigned descramble_bits(struct scrambler *s, unsigned bits,
+				unsigned num);
+
 #endif /* __M_DSP_H__ */
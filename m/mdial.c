@@ -24,8 +24,57 @@
  *  mdial.c - m dialer application
  */
 
+#include <stdio.h>
+
 #include "m.h"
 
+/* dials, or with caller id mode listens on hook: cid goes to the tty */
+static int mdial_start(struct modem *m)
+{
+	return modem_cid_mode ? modem_cid(m) :
+	    modem_dial(m, modem_phone_number);
+}
+
+/* one modem per line of a multichannel device ('<device>@<line>/<lines>'),
+ * all of them start and run in one engine; tty of line i is '<tty>i' */
+static int mdial_lines(unsigned int lines)
+{
+	static char ttys[DEV_GROUP_MAX_LINES][64];
+	struct modem *modems[DEV_GROUP_MAX_LINES];
+	char dev_name[128];
+	unsigned int i, n;
+	int ret = -1;
+
+	if (lines > DEV_GROUP_MAX_LINES) {
+		err("too many lines: %u\n", lines);
+		return -1;
+	}
+	for (n = 0; n < lines; n++) {
+		snprintf(dev_name, sizeof(dev_name), "%s@%u/%u",
+			 modem_device_name, n, lines);
+		snprintf(ttys[n], sizeof(ttys[n]), "%s%u", modem_tty_name, n);
+		modems[n] = modem_create_dev(ttys[n], modem_driver_name,
+					     dev_name);
+		if (!modems[n]) {
+			ret = -1;
+			goto _exit;
+		}
+		ret = mdial_start(modems[n]);
+		if (ret < 0) {
+			dbg("cannot start line %u.\n", n);
+			n++;
+			goto _exit;
+		}
+	}
+
+	ret = modem_run_all(modems, n);
+
+_exit:
+	for (i = 0; i < n; i++)
+		modem_delete(modems[i]);
+	return ret;
+}
+
 static int mdial(void)
 {
 	struct modem *m;
@@ -35,9 +84,9 @@ static int mdial(void)
 	if (!m)
 		return -1;
 
-	ret = modem_dial(m, modem_phone_number);
+	ret = mdial_start(m);
 	if (ret < 0) {
-		dbg("cannot dial.\n");
+		dbg("cannot start.\n");
 		return ret;
 	}
 
@@ -55,6 +104,6 @@ int main(int argc, char *argv[])
 	modem_phone_number = "8479999";
 	log_level = 1;
 	ret = parse_cmdline(argc, argv);
-	ret = mdial();
+	ret = modem_lines > 0 ? mdial_lines(modem_lines) : mdial();
 	return ret;
 }
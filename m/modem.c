@@ -30,7 +30,6 @@
 #include <signal.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <sys/poll.h>
 
 #include "m.h"
 
@@ -38,6 +37,8 @@ extern const struct dp_operations dialer_ops;
 extern const struct dp_operations detector_ops;
 extern const struct dp_operations v21_ops;
 extern const struct dp_operations v22_ops;
+extern const struct dp_operations dtmf_ops;
+extern const struct dp_operations cid_ops;
 
 static int modem_start(struct modem *m);
 static int modem_stop(struct modem *m);
@@ -48,6 +49,7 @@ const static char *modem_status_names[] = {
 	[STATUS_CONNECTING] = "connecting",
 	[STATUS_DP_CONNECT] = "dp connect",
 	[STATUS_DP_TIMEOUT] = "dp timeout",
+	[STATUS_BUSY] = "busy",
 };
 
 const static char *dp_names[] = {
@@ -56,6 +58,8 @@ const static char *dp_names[] = {
 	[DP_DETECTOR] = "detector",
 	[DP_V21] = "v21",
 	[DP_V22] = "v22",
+	[DP_DTMF] = "dtmf",
+	[DP_CID] = "cid",
 };
 
 const static struct dp_operations *dp_ops[] = {
@@ -63,6 +67,8 @@ const static struct dp_operations *dp_ops[] = {
 	[DP_DETECTOR] = &detector_ops,
 	[DP_V21] = &v21_ops,
 	[DP_V22] = &v22_ops,
+	[DP_DTMF] = &dtmf_ops,
+	[DP_CID] = &cid_ops,
 };
 
 #define modem_status_name(stat) (((stat) < arrsize(modem_status_names) && \
@@ -81,10 +87,22 @@ static int modem_get_chars(struct modem *m, uint8_t * buf, unsigned count)
 	return fifo_get(&m->tx_fifo, buf, count);
 }
 
+/* rx chars are collected and written out once per period, or when
+ * enough is queued; in split mode only control thread writes the tty */
+#define RX_FLUSH_THRESHOLD 256
+
 static int modem_put_chars(struct modem *m, uint8_t * buf, unsigned count)
 {
-	//return fifo_put(&m->rx_fifo, buf, count);
-	return write(m->tty, buf, count);
+	unsigned ret = fifo_put(&m->rx_fifo, buf, count);
+	if (ret < count) {
+		m->rx_dropped += count - ret;
+		dbg("rx fifo overflow: %u chars are dropped (%u total).\n",
+		    count - ret, m->rx_dropped);
+	}
+	if (!m->engine_rt && !m->tty_blocked &&
+	    fifo_len(&m->rx_fifo) >= RX_FLUSH_THRESHOLD)
+		modem_tty_flush(m);
+	return ret;
 }
 
 /*
@@ -97,6 +115,9 @@ void modem_update_status(struct modem *m, enum MODEM_STATUS status)
 	switch (status) {
 	case STATUS_NONE:
 		break;
+	case STATUS_BUSY:
+		info("\nBUSY\n");
+		/* fall through */
 	case STATUS_DP_TIMEOUT:
 		m->next_dp_id = DP_FAIL;
 	case STATUS_CONNECTING:
@@ -106,7 +127,8 @@ void modem_update_status(struct modem *m, enum MODEM_STATUS status)
 		m->data = m->command = 0;
 		break;
 	case STATUS_DP_CONNECT:
-		dbg("dp reports CONNECT\n");
+		dbg("dp reports CONNECT, round trip delay %d samples\n",
+		    m->driver->ctrl(m, MDRV_CTRL_DELAY, 0));
 		info("\nCONNECT\n");
 		m->get_bits = async_bitque_get_bits;
 		m->put_bits = async_bitque_put_bits;
@@ -131,13 +153,46 @@ void modem_update_signals(struct modem *m, unsigned int signals)
 			    signals & MASK(n) ? "etect" : "isappear");
 	}
 #endif
-	if (signals & (MASK(SIGNAL_ANSAM)))
+	if (signals & (MASK(SIGNAL_BUSY) | MASK(SIGNAL_REORDER)))
+		modem_update_status(m, STATUS_BUSY);
+	else if (signals & (MASK(SIGNAL_ANSAM)))
 		/* nothing yet */ ;
 	else if (signals & (MASK(SIGNAL_2225) | MASK(SIGNAL_2245)))
 		m->next_dp_id = DP_V22;
 	m->signals_detected = signals;
 }
 
+#define DLE 0x10
+
+/* goes to tty shielded by DLE, the way voice modems report it */
+void modem_update_dtmf(struct modem *m, char digit)
+{
+	uint8_t buf[2] = { DLE, digit };
+	dbg("update_dtmf: digit %c\n", digit);
+	info("\nDTMF %c\n", digit);
+	modem_put_chars(m, buf, sizeof(buf));
+}
+
+/* goes to tty as is, also in command mode */
+void modem_update_cid(struct modem *m, const struct cid_info *cid)
+{
+	char buf[160];
+	int n = 0;
+	if (cid->date[0])
+		n += sprintf(buf + n, "\r\nDATE = %s", cid->date);
+	if (cid->time[0])
+		n += sprintf(buf + n, "\r\nTIME = %s", cid->time);
+	if (cid->number[0])
+		n += sprintf(buf + n, "\r\nNMBR = %s", cid->number);
+	if (cid->name[0])
+		n += sprintf(buf + n, "\r\nNAME = %s", cid->name);
+	n += sprintf(buf + n, "\r\n");
+	dbg("update_cid: %s\n", buf);
+	info("\nCID: date %s, time %s, number '%s', name '%s'\n",
+	     cid->date, cid->time, cid->number, cid->name);
+	modem_put_chars(m, (uint8_t *) buf, n);
+}
+
 static void drop_all(struct modem *m)
 {
 	trace();
@@ -205,25 +260,115 @@ static int modem_null_process(struct modem *m,
 	return count;
 }
 
-#define DEV_BUF_SIZE PERIOD_SIZE
+/* samples lost by device xrun are run as silence, so the datapump timing
+ * stays; what it sends for them is late and dropped */
+static int modem_dev_lost(struct modem *m,
+			  int (*process) (struct modem * m,
+					  int16_t * in, int16_t * out,
+					  unsigned count))
+{
+	int16_t *buf_in = m->dev_buf_in, *buf_out = m->dev_buf_out;
+	unsigned int count;
+	int ret;
+
+	dbg("device lost %u samples\n", m->dev_lost);
+	memset(buf_in, 0, sizeof(m->dev_buf_in));
+	while (m->dev_lost) {
+		count = m->dev_lost < DEV_BUF_SIZE ? m->dev_lost : DEV_BUF_SIZE;
+		if ((ret = process(m, buf_in, buf_out, count)) < 0) {
+			err("process failed\n");
+			return ret;
+		}
+		if (ret < count && !m->next_dp_id)
+			m->next_dp_id = DP_FAIL;
+		m->dev_lost -= count;
+		samples_timer_update(m, count);
+		if (m->next_dp_id) {
+			ret = modem_switch_datapump(m, m->next_dp_id);
+			m->next_dp_id = 0;
+			if (ret < 0)
+				return ret;
+			process = m->process ? m->process : modem_null_process;
+		}
+	}
+	return 0;
+}
+
+/* zero copy: datapump works right in device buffers, a period may come
+ * in two pieces where they wrap */
+static int modem_dev_process_mmap(struct modem *m,
+				  int (*process) (struct modem * m,
+						  int16_t * in, int16_t * out,
+						  unsigned count))
+{
+	int16_t *in, *out;
+	int ret, count, total = 0;
+
+	while (total < DEV_BUF_SIZE && !m->next_dp_id) {
+		ret = m->driver->mmap_begin(m, &in, &out, DEV_BUF_SIZE - total,
+					    total > 0);
+		if (ret <= 0)
+			return total ? total : ret;
+		count = ret;
+		if ((ret = process(m, in, out, count)) < 0) {
+			err("process failed\n");
+			return ret;
+		}
+
+		dbg("dp process(%d) = %d\n", count, ret);
+
+		if (ret < count) {
+			memset(out + ret, 0, (count - ret) * sizeof(int16_t));
+			if (!m->next_dp_id)
+				m->next_dp_id = DP_FAIL;
+		}
+
+		log_rx_samples(in, count);
+		log_tx_samples(out, count);
 
-static int modem_dev_process(struct modem *m)
+		if ((ret = m->driver->mmap_commit(m, count)) < 0) {
+			err("device commit failed.\n");
+			return ret;
+		}
+		total += count;
+	}
+	return total;
+}
+
+int modem_dev_process(struct modem *m)
 {
-	static int16_t buf_in[DEV_BUF_SIZE], buf_out[DEV_BUF_SIZE];
+	int16_t *buf_in = m->dev_buf_in, *buf_out = m->dev_buf_out;
 	int (*process) (struct modem * m,
 			int16_t * in, int16_t * out, unsigned count);
 	int ret, count;
 
 	trace("%d:", m->samples_count);
 
-	ret = m->driver->read(m, buf_in, arrsize(buf_in));
+	process = m->process ? m->process : modem_null_process;
+
+	if (m->dev_lost) {
+		if ((ret = modem_dev_lost(m, process)) < 0)
+			goto _error;
+		process = m->process ? m->process : modem_null_process;
+	}
+
+	if (m->driver->mmap_begin &&
+	    (ret = modem_dev_process_mmap(m, process)) != -ENOSYS) {
+		if (ret <= 0) {
+			dbg("device mmap = %d\n", ret);
+			goto _error;
+		}
+		count = ret;
+		goto _done;
+	}
+
+	ret = m->driver->read(m, buf_in, arrsize(m->dev_buf_in));
 	if (ret <= 0) {
 		dbg("device read = %d\n", ret);
 		goto _error;
 	}
 
 	count = ret;
-	process = m->process ? m->process : modem_null_process;
 	if ((ret = process(m, buf_in, buf_out, count)) < 0) {
 		err("process failed\n");
 		goto _error;
@@ -243,11 +388,12 @@ static int modem_dev_process(struct modem *m)
 		goto _error;
 	}
 
-	samples_timer_update(m, count);
-
 	log_rx_samples(buf_in, count);
 	log_tx_samples(buf_out, count);
 
+_done:
+	samples_timer_update(m, count);
+
 	if (m->next_dp_id) {
 		ret = modem_switch_datapump(m, m->next_dp_id);
 		m->next_dp_id = 0;
@@ -257,82 +403,99 @@ _error:
 	return ret;
 }
 
+/* returns > 0 when tty is closed and should not be polled for a while */
 int modem_tty_process(struct modem *m)
 {
-	static unsigned char tty_buf[4096];
+	unsigned char *buf;
 	int cnt;
 	dbg("poll: ttyfd...\n");
-	cnt = fifo_room(&m->tx_fifo);
-	if (cnt > sizeof(tty_buf))
-		cnt = sizeof(tty_buf);
-	cnt = read(m->tty, tty_buf, cnt);
+	cnt = fifo_reserve(&m->tx_fifo, &buf);
+	if (!cnt)
+		return 0;
+	cnt = read(m->tty, buf, cnt);
 	if (cnt < 0) {
-		if (errno == -EIO) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		if (errno == EIO) {
 			dbg("closed tty - suspend poll.\n");
-			return 100;	/* closed_tty_count = 100; */
+			return 1;
 		}
 		return cnt;
 	}
+	if (!cnt) {
+		dbg("tty eof - suspend poll.\n");
+		return 1;
+	}
 	dbg("got %d chars from tty.\n", cnt);
-	fifo_put(&m->tx_fifo, tty_buf, cnt);
+	fifo_commit(&m->tx_fifo, cnt);
 	return 0;
 }
 
-int modem_run(struct modem *m)
+/* writes out received chars; never blocks - when tty doesn't take
+ * everything, tty_blocked is set and engine waits for POLLOUT */
+int modem_tty_flush(struct modem *m)
 {
-	struct pollfd pollfd[2];
-	unsigned int nfds;
-	unsigned closed_tty_count = 0;
-	struct pollfd *devfd, *ttyfd;
-	int ret = 0;
-
-	trace();
-
-	while (!m->killed) {
-		nfds = 0;
-		memset(pollfd, 0, sizeof(pollfd));
-		pollfd[0].events = pollfd[1].events = POLLIN;
-		devfd = ttyfd = NULL;
-		if (m->started) {
-			devfd = &pollfd[nfds++];
-			devfd->fd = m->dev;
-		}
-		if (closed_tty_count)
-			closed_tty_count--;
-		else if (fifo_room(&m->tx_fifo)) {
-			ttyfd = &pollfd[nfds++];
-			ttyfd->fd = m->tty;
-		}
-
-		ret = poll(pollfd, nfds, 1000);
+	unsigned char *buf;
+	int cnt, ret, total = 0;
+	m->tty_blocked = 0;
+	while ((cnt = fifo_peek(&m->rx_fifo, &buf))) {
+		ret = write(m->tty, buf, cnt);
 		if (ret < 0) {
-			if (errno == EINTR) {
-				ret = 0;
+			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN) {
+				m->tty_blocked = 1;
+				break;
 			}
-			err("poll error: %s\n", strerror(errno));
+			/* nobody listens - drop it */
+			dbg("tty write failed: %s\n", strerror(errno));
+			m->rx_dropped += fifo_len(&m->rx_fifo);
+			fifo_consume(&m->rx_fifo, fifo_len(&m->rx_fifo));
 			break;
 		}
-		if (ret == 0) {	/* timeout */
-			closed_tty_count = 0;
-			continue;
-		}
-		if (devfd && (devfd->revents & POLLIN)) {
-			ret = modem_dev_process(m);
-			if (ret < 0)
-				break;
-		}
-		if (ttyfd && (ttyfd->revents & POLLIN)) {
-			ret = modem_tty_process(m);
-			if (ret < 0)
-				break;
-			closed_tty_count = ret;
+		fifo_consume(&m->rx_fifo, ret);
+		total += ret;
+		if (ret < cnt) {
+			m->tty_blocked = 1;
+			break;
 		}
 	}
+	return total;
+}
+
+/* all modems go to one engine, so lines of a group share its wakeups */
+int modem_run_all(struct modem **modems, unsigned int count)
+{
+	struct modem_engine *e;
+	unsigned int i;
+	int ret = 0;
+
+	trace("%u", count);
+
+	e = modem_engine_create();
+	if (!e)
+		return -1;
+	/* workers or sample thread, only when asked */
+	if (modem_workers > 0) {
+		if (modem_engine_set_workers(e, modem_workers) < 0)
+			dbg("run without workers.\n");
+	} else if ((modem_rt_priority > 0 || modem_rt_cpu >= 0) &&
+		   modem_engine_set_rt(e, modem_rt_priority, modem_rt_cpu) < 0)
+		dbg("run without sample thread.\n");
+	for (i = 0; i < count && !ret; i++)
+		ret = modem_engine_add(e, modems[i]);
+	if (!ret)
+		ret = modem_engine_run(e);
+	modem_engine_delete(e);
 
 	return ret;
 }
 
+int modem_run(struct modem *m)
+{
+	return modem_run_all(&m, 1);
+}
+
 int modem_set_hook(struct modem *m, unsigned hook_off)
 {
 	int ret;
@@ -402,13 +565,41 @@ int modem_dial(struct modem *m, const char *dial_string)
 	trace("%s...", dial_string);
 	m->caller = 1;
 	m->signals_to_detect = MASK(SIGNAL_2100) | MASK(SIGNAL_ANSAM) |
-	    MASK(SIGNAL_2225) | MASK(SIGNAL_2245);
+	    MASK(SIGNAL_2225) | MASK(SIGNAL_2245) |
+	    MASK(SIGNAL_BUSY) | MASK(SIGNAL_REORDER) | MASK(SIGNAL_RINGBACK);
 	m->signals_detected = 0;
 	strncpy(m->dial_string, dial_string, sizeof(m->dial_string));
 	ret = modem_go(m, DP_DIALER);
 	return ret;
 }
 
+/* listens on hook, line audio comes through cid switch */
+int modem_cid(struct modem *m)
+{
+	int ret;
+	trace();
+	m->data = 0;
+	m->command = 0;
+	if ((ret = m->driver->ctrl(m, MDRV_CTRL_CID, 1)) < 0) {
+		err("cannot set cid\n");
+		goto _error;
+	}
+	if ((ret = modem_start(m)) < 0) {
+		err("cannot start modem\n");
+		goto _error;
+	}
+	if ((ret = modem_switch_datapump(m, DP_CID)) < 0) {
+		err("cannot switch dp\n");
+		goto _error;
+	}
+	fifo_reset(&m->rx_fifo);
+	return 0;
+_error:
+	m->driver->ctrl(m, MDRV_CTRL_CID, 0);
+	modem_stop(m);
+	return ret;
+}
+
 static void sregs_reset(struct modem *m)
 {
 	m->sregs[0] = 0;	/* autoanswer rings count */
@@ -440,20 +631,19 @@ static void modem_reset(struct modem *m)
 	fifo_reset(&m->tx_fifo);
 	m->caller = 0;
 	modem_set_hook(m, 0);
+	m->driver->ctrl(m, MDRV_CTRL_CID, 0);
 }
 
 #define MODEM_NAME "MA (modem again)"
 #define MODEM_DESC "SashaK's softmodem attempt"
 #define MODEM_VERSION "0.000003"
 
-/* hack */
-static struct modem *__modem_last;
+/* shared by all modems in process, checked by engine loop */
+volatile sig_atomic_t modem_killed;
 
 static void mark_killed(int signum)
 {
-	struct modem *m = __modem_last;
-	dbg("mark_killed: %d...\n", signum);
-	m->killed = signum;
+	modem_killed = signum;
 }
 
 static int make_terminal(const char *link_name)
@@ -505,7 +695,9 @@ int setup_terminal(int tty)
 	return ret;
 }
 
-struct modem *modem_create(const char *tty_name, const char *drv_name)
+/* dev_name is passed to the driver as is, e.g. a line of a group */
+struct modem *modem_create_dev(const char *tty_name, const char *drv_name,
+			       const char *dev_name)
 {
 	struct modem *m;
 	const struct modem_driver *drv;
@@ -522,9 +714,13 @@ struct modem *modem_create(const char *tty_name, const char *drv_name)
 		return NULL;
 	memset(m, 0, sizeof(*m));
 
+	if (fifo_init(&m->rx_fifo, FIFO_SIZE) < 0 ||
+	    fifo_init(&m->tx_fifo, FIFO_SIZE) < 0)
+		goto _error;
+
 	if (tty_name && (tty = make_terminal(tty_name)) < 0) {
 		err("cannot make terminal for \'%s\'\n", tty_name);
-		return NULL;
+		goto _error;
 	}
 
 	m->name = MODEM_NAME;
@@ -545,13 +741,12 @@ struct modem *modem_create(const char *tty_name, const char *drv_name)
 
 	sregs_reset(m);
 
-	m->dev = m->driver->open(m, modem_device_name);
+	m->dev = m->driver->open(m, dev_name);
 	if (m->dev < 0) {
 		err("cannot open device.\n");
 		goto _error;
 	}
 
-	__modem_last = m;
 	signal(SIGINT, mark_killed);
 	signal(SIGTERM, mark_killed);
 
@@ -560,13 +755,22 @@ struct modem *modem_create(const char *tty_name, const char *drv_name)
 
 	return m;
 _error:
+	fifo_free(&m->rx_fifo);
+	fifo_free(&m->tx_fifo);
 	free(m);
 	return NULL;
 }
 
+struct modem *modem_create(const char *tty_name, const char *drv_name)
+{
+	return modem_create_dev(tty_name, drv_name, modem_device_name);
+}
+
 void modem_delete(struct modem *m)
 {
 	trace();
+	if (m->engine)
+		modem_engine_remove(m->engine, m);
 	if (m->started)
 		modem_stop(m);
 	modem_reset(m);
@@ -577,5 +781,7 @@ void modem_delete(struct modem *m)
 	if (m->tty_link_name)
 		unlink(m->tty_link_name);
 
+	fifo_free(&m->rx_fifo);
+	fifo_free(&m->tx_fifo);
 	free(m);
 }
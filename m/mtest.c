@@ -34,6 +34,8 @@ const static char *known_modulation_tests[] = {
 	[DP_DETECTOR] = "detector",
 	[DP_V21] = "v21",
 	[DP_V22] = "v22",
+	[DP_DTMF] = "dtmf",
+	[DP_CID] = "cid",
 	[DP_LAST] = NULL,
 };
 
@@ -69,7 +71,7 @@ static int mtest(unsigned dp_id)
 	m->signals_to_detect |= MASK(SIGNAL_2100) | MASK(SIGNAL_ANSAM) |
 	    MASK(SIGNAL_2225) | MASK(SIGNAL_2245);
 
-	ret = modem_go(m, dp_id);
+	ret = dp_id == DP_CID ? modem_cid(m) : modem_go(m, dp_id);
 	if (ret < 0) {
 		dbg("cannot go with modem.\n");
 		return ret;
@@ -0,0 +1,103 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   nco.c - numerically controlled oscillators
+ *
+ *   Sine blocks are generated from the phase ramp, a kernel (scalar or
+ *   AVX2 gather) is chosen once by cpu features. Both give the same
+ *   samples.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "m_dsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NCO_X86 1
+#endif
+
+static uint32_t nco_generate_scalar(uint32_t phase, uint32_t phinc,
+				    int16_t * buf, unsigned count)
+{
+	unsigned i;
+	for (i = 0; i < count; i++, phase += phinc)
+		buf[i] = nco_sin(phase);
+	return phase;
+}
+
+#ifdef NCO_X86
+/* gather wants 32 bit elements */
+static int32_t nco_costab32[COSTAB_SIZE];
+
+__attribute__ ((target("avx2")))
+static uint32_t nco_generate_avx2(uint32_t phase, uint32_t phinc,
+				  int16_t * buf, unsigned count)
+{
+	const __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i step = _mm256_set1_epi32(phinc * 8);
+	__m256i ph = _mm256_mullo_epi32(_mm256_set1_epi32(phinc), ramp);
+	unsigned i;
+
+	/* sin is cos a quarter turn back */
+	ph = _mm256_add_epi32(ph, _mm256_set1_epi32(phase - NCO_QUARTER));
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i idx = _mm256_srli_epi32(ph, NCO_SHIFT);
+		__m256i v = _mm256_i32gather_epi32(nco_costab32, idx, 4);
+		__m128i s = _mm_packs_epi32(_mm256_castsi256_si128(v),
+					    _mm256_extracti128_si256(v, 1));
+		_mm_storeu_si128((__m128i *) (buf + i), s);
+		ph = _mm256_add_epi32(ph, step);
+	}
+	return nco_generate_scalar(phase + i * phinc, phinc, buf + i,
+				   count - i);
+}
+#endif
+
+static uint32_t(*nco_kernel) (uint32_t, uint32_t, int16_t *, unsigned);
+static pthread_once_t nco_kernel_once = PTHREAD_ONCE_INIT;
+
+static void nco_select_kernel(void)
+{
+	const char *name = "scalar";
+	nco_kernel = nco_generate_scalar;
+#ifdef NCO_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		unsigned i;
+		for (i = 0; i < COSTAB_SIZE; i++)
+			nco_costab32[i] = costab[i];
+		nco_kernel = nco_generate_avx2;
+		name = "avx2";
+	}
+#endif
+	dbg("nco: using %s kernel\n", name);
+}
+
+void nco_generate(struct nco *n, int16_t * buf, unsigned count)
+{
+	pthread_once(&nco_kernel_once, nco_select_kernel);
+	n->phase = nco_kernel(n->phase, n->phinc, buf, count);
+}
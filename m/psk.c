@@ -41,153 +41,246 @@ const unsigned int qpsk_phases_C[] = { 3, 2, 0, 1 };
 #define qpsk_symbols qpsk_symbols_A
 #define qpsk_phases qpsk_phases_A
 
+/*
+ * Demodulator: the signal is mixed down to baseband sample by sample, but
+ * matched filter runs only at strobes - twice per symbol, as Gardner timing
+ * detector wants it.  Strobe times come from the timing NCO, which wraps at
+ * every strobe; the rrc polyphase branch nearest to the strobe time is used
+ * as the interpolator.  Decisions are differential, at on-time strobes.
+ */
+
+/* timing NCO: one strobe interval, loop gains are shifts of the normalized
+ * (Q16) Gardner error */
+#define PSK_CLOCK_WRAP (1LL << 32)
+#define PSK_TIMING_KP 3
+#define PSK_TIMING_KI 13
+
 int psk_demodulator_init(struct psk_demodulator *p, struct modem *m,
-			 unsigned freq, unsigned symbol_rate)
+			 unsigned freq, unsigned symbol_rate,
+			 const int16_t * shape, unsigned shape_size)
 {
-	int i;
+	unsigned phases, len;
 
 	memset(p, 0, sizeof(*p));
-
 	p->modem = m;
-	p->filter_len = SAMPLE_RATE * 2 / symbol_rate < PSK_FILTER_LEN ?
-	    SAMPLE_RATE * 2 / symbol_rate : PSK_FILTER_LEN;
-	p->phinc = freq * COSTAB_SIZE / SAMPLE_RATE;
-	p->hist_index = 0;
-
-	i = p->filter_len / 2;
-	while (i) {
-		p->shift++;
-		i >>= 1;
-	}
-	p->shift =
-	    (15 - COSTAB_SHIFT > p->shift) ? 0 : p->shift - (15 - COSTAB_SHIFT);
 	p->symbol_rate = symbol_rate;
+
+	phases = symbol_rate / gcd(SAMPLE_RATE, symbol_rate);
+	len = shape_size / phases;
+	if (phases > PSK_DEM_PHASES || len > PSK_DEM_LEN ||
+	    len * phases != shape_size) {
+		err("cannot demodulate %u Bd with %u taps shape\n",
+		    symbol_rate, shape_size);
+		return -1;
+	}
+	p->shape = shape;
+	p->phases = phases;
+	p->len = len;
+	p->phinc = NCO_PHINC(freq);
+	p->step = 2 * symbol_rate * PSK_CLOCK_WRAP / SAMPLE_RATE;
 	return 0;
 }
 
+/* matched filter output at (newest history sample - 1 + phase/phases),
+ * minus constant filter delay */
+static void psk_strobe(struct psk_demodulator *p, unsigned newest,
+		       unsigned phase, int32_t * x, int32_t * y)
+{
+	const int16_t *h = p->shape + phase * p->len;
+	const int16_t *bx = p->history_x + newest + PSK_DEM_HIST;
+	const int16_t *by = p->history_y + newest + PSK_DEM_HIST;
+	int64_t sx = 0, sy = 0;
+	int i;
+
+	for (i = 0; i < p->len; i++) {
+		sx += bx[-i] * h[i];
+		sy += by[-i] * h[i];
+	}
+	*x = sx >> 16;
+	*y = sy >> 16;
+}
+
+static void psk_decide(struct psk_demodulator *p, int32_t x0, int32_t y0,
+		       int32_t x1, int32_t y1)
+{
+	int64_t x, y;
+	unsigned ph;
+
+	/* phase of symbol 1 against symbol 0 */
+	x = (int64_t) x0 *x1 + (int64_t) y0 *y1;
+	y = (int64_t) x0 *y1 - (int64_t) y0 *x1;
+
+	x = x - y;
+	y = x + 2 * y;
+	if ((x > 0 && y > 0) || (x < 0 && y < 0))
+		ph = (x > 0) ? 0 : 2;
+	else
+		ph = (y > 0) ? 1 : 3;
+
+	//dbg("%u: x = %lld, y = %lld ; phase = %d\n",
+	//      p->modem->samples_count, x, y, ph);
+	if (p->put_symbol)
+		p->put_symbol(p->modem, qpsk_symbols[ph]);
+}
+
+static void psk_timing(struct psk_demodulator *p, int32_t x, int32_t y)
+{
+	const int32_t max_adj = p->step >> 6;	/* 1.5% of clock */
+	int64_t e, pwr;
+
+	/* Gardner: mid-symbol sample against the transition through it */
+	e = (int64_t) (x - p->x) * p->mid_x + (int64_t) (y - p->y) * p->mid_y;
+	pwr = (int64_t) x *x + (int64_t) y *y +
+	    (int64_t) p->x * p->x + (int64_t) p->y * p->y;
+	if (!pwr)
+		return;
+	e = (e << 16) / pwr;
+	if (e > 1 << 16)
+		e = 1 << 16;
+	else if (e < -(1 << 16))
+		e = -(1 << 16);
+
+	/* late strobes give positive error: pull the next one in */
+	p->clock += (e * p->step) >> (16 + PSK_TIMING_KP);
+	p->clock_adj += (e * p->step) >> (16 + PSK_TIMING_KI);
+	if (p->clock_adj > max_adj)
+		p->clock_adj = max_adj;
+	else if (p->clock_adj < -max_adj)
+		p->clock_adj = -max_adj;
+}
+
 int psk_demodulate(struct psk_demodulator *p, int16_t * buf, unsigned count)
 {
-	const unsigned int phinc = p->phinc;
-	const unsigned len = p->filter_len;
-	const unsigned shift = p->shift;
+	const uint32_t phinc = p->phinc;
+	const uint32_t step = p->step + p->clock_adj;
+	uint32_t phase = p->phase;
 	unsigned idx = p->hist_index;
-	unsigned int symbol;
-	int i, j;
+	int i;
 
 	for (i = 0; i < count; i++) {
-		//int16_t d0;	// debug
-		int32_t x0, x1, y0, y1, x, y;
-		unsigned ph, ph0, ph1;
-		unsigned idx0, idx1;
-
-		p->history[idx % len] = buf[i] >> shift;
-		idx = (idx + 1) % len;
-
-		ph0 = 0;
-		ph1 = phinc * len / 2;
-		idx0 = idx;
-		idx1 = (idx + len / 2) % len;
-		x0 = x1 = y0 = y1 = 0;
-		for (j = 0; j < len / 2; j++) {
-			x0 += m_cos(ph0) * p->history[idx0];
-			y0 -= m_sin(ph0) * p->history[idx0];
-			x1 += m_cos(ph1) * p->history[idx1];
-			y1 -= m_sin(ph1) * p->history[idx1];
-			ph0 += phinc;
-			ph1 += phinc;
-			idx0 = (idx0 + 1) % len;
-			idx1 = (idx1 + 1) % len;
-		}
-		x0 >>= COSTAB_SHIFT;
-		x1 >>= COSTAB_SHIFT;
-		y0 >>= COSTAB_SHIFT;
-		y1 >>= COSTAB_SHIFT;
-
-		x = x0 * x1 + y0 * y1;
-		y = x0 * y1 - y0 * x1;
-
-		// FIXME: when no signal - result is mess
-#if 1
-		x = x - y;
-		y = x + 2 * y;
-		x >>= 16;	//COSTAB_SHIFT;
-		y >>= 16;	//COSTAB_SHIFT;
-		//d0 = x<<3; log_data(16, &d0, sizeof(d0));
-		//d0 = y<<3; log_data(17, &d0, sizeof(d0));
-		if (x * y > 0)
-			ph = (x > 0) ? 0 : 2;
-		else
-			ph = (y > 0) ? 1 : 3;
-#else
-		if (x && (y / x) == 0)
-			ph = (x > 0) ? 0 : 2;
+		unsigned frac, newest;
+		int32_t x, y;
+
+		p->history_x[idx] = p->history_x[idx + PSK_DEM_HIST] =
+		    (buf[i] * nco_cos(phase)) >> COSTAB_SHIFT;
+		p->history_y[idx] = p->history_y[idx + PSK_DEM_HIST] =
+		    -(buf[i] * nco_sin(phase)) >> COSTAB_SHIFT;
+		phase += phinc;
+		newest = idx;
+		if (++idx == PSK_DEM_HIST)
+			idx = 0;
+
+		p->clock += step;
+		if (p->clock < PSK_CLOCK_WRAP)
+			continue;
+		p->clock -= PSK_CLOCK_WRAP;
+
+		/* strobe was clock/step samples ago: pick the branch */
+		frac = (p->phases * (step - p->clock) + step / 2) / step;
+		if (frac == p->phases)
+			frac = 0;
 		else
-			ph = (y > 0) ? 1 : 3;
-#endif
-
-		//d0 = ph<<13 ; log_data(22, &d0, sizeof(d0));
-		//dbg("%u: x = %d, y = %d ; phase = %d\n",
-		//      p->modem->samples_count + i, x, y, ph);
-
-		symbol = qpsk_symbols[ph];
-#define READY_TO_DECODE_BITS 1
-#ifdef READY_TO_DECODE_BITS
-		p->symbol_count += p->symbol_rate;
-		if (p->symbol != symbol) {
-			if (p->symbol_count > SAMPLE_RATE / 2 && p->put_symbol) {
-				p->put_symbol(p->modem, p->symbol);
-				//dbg("%u: put_symbol: %01x\n",
-				//      p->modem->samples_count, p->symbol&0x3);
-			}
-			p->symbol = symbol;
-			p->symbol_count = 0;
-		} else if (p->symbol_count >= SAMPLE_RATE) {
-			if (p->put_symbol) {
-				p->put_symbol(p->modem, p->symbol);
-				//dbg("%u: put_symbol: %01x\n",
-				//      p->modem->samples_count, p->symbol&0x3);
-			}
-			p->symbol_count -= SAMPLE_RATE;
+			newest = (newest + PSK_DEM_HIST - 1) % PSK_DEM_HIST;
+		psk_strobe(p, newest, frac, &x, &y);
+
+		if (p->strobe++ & 1) {
+			psk_timing(p, x, y);
+			psk_decide(p, p->x, p->y, x, y);
+			p->x = x;
+			p->y = y;
+		} else {
+			p->mid_x = x;
+			p->mid_y = y;
 		}
-#endif
 	}
 
-	p->hist_index = idx % len;
+	p->phase = phase;
+	p->hist_index = idx;
 	return i;
 }
 
+/*
+ * Modulator: the rrc shape comes as polyphase subfilters, one per possible
+ * fractional offset of the symbol start against the output sample.  Since
+ * the carrier is a multiple of symbol rate it has the same phase at every
+ * symbol start, so for each subfilter and each of four carrier quadrants
+ * the whole passband response is built here once.
+ */
+
 int psk_modulator_init(struct psk_modulator *p, struct modem *m,
-		       unsigned freq, unsigned symbol_rate)
+		       unsigned freq, unsigned symbol_rate,
+		       const int16_t * shape, unsigned shape_size)
 {
+	unsigned phases, len;
+	unsigned i, j, q;
+
 	memset(p, 0, sizeof(*p));
 	p->modem = m;
 	p->symbol_rate = symbol_rate;
-	p->phinc = freq * COSTAB_SIZE / SAMPLE_RATE;
+
+	phases = symbol_rate / gcd(SAMPLE_RATE, symbol_rate);
+	len = shape_size / phases;
+	if (freq % symbol_rate || phases > PSK_MOD_PHASES ||
+	    len > PSK_MOD_LEN || len * phases != shape_size) {
+		err("cannot modulate %u Hz at %u Bd with %u taps shape\n",
+		    freq, symbol_rate, shape_size);
+		return -1;
+	}
+	p->phases = phases;
+	p->len = len;
+
+	for (i = 0; i < phases; i++)
+		for (j = 0; j < len; j++) {
+			/* carrier phase at j + i/phases samples from start,
+			 * rounded to the nearest costab entry */
+			uint32_t ph = ((uint64_t) freq << 32) *
+			    (j * phases + i) / (phases * SAMPLE_RATE) +
+			    (1U << (NCO_SHIFT - 1));
+			/* unit envelope goes out at quarter scale */
+			for (q = 0; q < 4; q++)
+				p->resp[i][q][j] = (shape[i * len + j] *
+						    nco_cos(ph + q * NCO_QUARTER))
+				    >> (COSTAB_SHIFT + 2);
+		}
 	return 0;
 }
 
 int psk_modulate(struct psk_modulator *p, int16_t * buf, unsigned count)
 {
-	unsigned int phinc = p->phinc;
-	unsigned int phase = p->phase;
 	unsigned int symbol_count = p->symbol_count;
 	unsigned int symbol_rate = p->symbol_rate;
-	int i;
+	unsigned int index = p->index;
+	int i, j;
+
 	for (i = 0; i < count; i++) {
-		buf[i] = m_cos(phase) >> 1;	// FIXME: >>1
-		phase += phinc;
 		symbol_count += symbol_rate;
 		if (symbol_count >= SAMPLE_RATE) {
 			unsigned int symbol = 0xf;
+			const int16_t *resp;
 			if (p->get_symbol)
 				symbol = p->get_symbol(p->modem);
 			//dbg("%d: getsymbol() = %d...\n",symbol_count,symbol);
 			symbol_count -= SAMPLE_RATE;
-			phase += qpsk_phases[symbol & 3] * COSTAB_SIZE / 4;
+			/* symbol started symbol_count/symbol_rate ago */
+			p->quadrant = (p->quadrant + qpsk_phases[symbol & 3]) & 3;
+			resp = p->resp[symbol_count * p->phases /
+				       symbol_rate][p->quadrant];
+			/* ring is doubled, the upper half is folded back
+			 * when passed */
+			for (j = 0; j < p->len; j++)
+				p->ring[index + j] += resp[j];
+		}
+		buf[i] = p->ring[index];
+		p->ring[index] = 0;
+		if (++index == PSK_MOD_RING) {
+			memcpy(p->ring, p->ring + PSK_MOD_RING,
+			       PSK_MOD_RING * sizeof(*p->ring));
+			memset(p->ring + PSK_MOD_RING, 0,
+			       PSK_MOD_RING * sizeof(*p->ring));
+			index = 0;
 		}
 	}
-	p->phase = phase % COSTAB_SIZE;
-	p->phinc = phinc;
+	p->index = index;
 	p->symbol_count = symbol_count;
 	return count;
 }
@@ -0,0 +1,112 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   resample.c - fractional resampler
+ *
+ *   For rates that differ by a little - clock drift between capture and
+ *   playback. Each output sample is taken at a fractional position in
+ *   the input with a polyphase windowed sinc: the two nearest of the
+ *   RESAMPLE_PHASES filters are run and interpolated linearly. The delay
+ *   is RESAMPLE_TAPS/2 input samples.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_dsp.h"
+
+static int32_t resample_dot(const int16_t * x, const int16_t * h)
+{
+	int32_t sum = 0;
+	unsigned i;
+	for (i = 0; i < RESAMPLE_TAPS; i++)
+		sum += x[i] * h[i];
+	return sum;
+}
+
+/* count - max input per call */
+int resampler_init(struct resampler *r, unsigned count)
+{
+	memset(r, 0, sizeof(*r));
+	r->size = RESAMPLE_TAPS + 2 * count;
+	r->buf = malloc(r->size * sizeof(*r->buf));
+	if (!r->buf)
+		return -1;
+	r->step = RESAMPLE_ONE;
+	resampler_reset(r);
+	return 0;
+}
+
+void resampler_free(struct resampler *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/* history is cleared, step is kept */
+void resampler_reset(struct resampler *r)
+{
+	r->len = RESAMPLE_TAPS - 1;
+	r->pos = 0;
+	memset(r->buf, 0, r->len * sizeof(*r->buf));
+}
+
+/* returns output samples, about count * RESAMPLE_ONE / step */
+unsigned resample(struct resampler *r, const int16_t * in, unsigned count,
+		  int16_t * out, unsigned max)
+{
+	const int16_t *h;
+	unsigned idx, phase, n = 0;
+	int32_t a, b, frac;
+
+	if (count > r->size - r->len)
+		count = r->size - r->len;
+	memcpy(r->buf + r->len, in, count * sizeof(*in));
+	r->len += count;
+
+	while (n < max) {
+		idx = r->pos >> 32;
+		if (idx + RESAMPLE_TAPS > r->len)
+			break;
+		/* top bits of the fraction pick the phase, next 15 weight it */
+		phase = (uint32_t) r->pos >> (32 - __builtin_ctz(RESAMPLE_PHASES));
+		frac = ((uint32_t) r->pos >> (17 - __builtin_ctz(RESAMPLE_PHASES)))
+		    & 0x7fff;
+		h = resample_fir + phase * RESAMPLE_TAPS;
+		a = resample_dot(r->buf + idx, h);
+		b = resample_dot(r->buf + idx, h + RESAMPLE_TAPS);
+		a += ((int64_t) (b - a) * frac) >> 15;
+		a >>= COSTAB_SHIFT;
+		out[n++] = a > 32767 ? 32767 : a < -32768 ? -32768 : a;
+		r->pos += r->step;
+	}
+
+	/* keep what the next output needs */
+	idx = r->pos >> 32;
+	if (idx > r->len)
+		idx = r->len;
+	memmove(r->buf, r->buf + idx, (r->len - idx) * sizeof(*r->buf));
+	r->len -= idx;
+	r->pos -= (uint64_t) idx << 32;
+	return n;
+}
@@ -0,0 +1,157 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   scrambler.c - self-synchronizing scrambler, 1 + x^-14 + x^-17
+ *
+ *   Bits are processed by words, msb (first on line) first. Scrambler
+ *   feeds its output back, so at most 14 bits may be computed at once;
+ *   descrambler is feed-forward and takes up to 32 bits per step. The
+ *   "invert after 64 ones" rule is checked per word and only the words
+ *   where it may trigger go the serial way.
+ */
+
+#include "m_dsp.h"
+
+#define SCRAMBLER_STEP 14
+
+/* serial reference implementation */
+
+unsigned scramble_bit(struct scrambler *s, unsigned bit)
+{
+	bit = bit ^ (s->data >> (14 - 1)) ^ (s->data >> (17 - 1));
+	if (s->one_count == 64) {
+		bit ^= 1;
+		s->one_count = 0;
+	}
+	if (bit & 1)
+		s->one_count++;
+	else
+		s->one_count = 0;
+	s->data <<= 1;
+	s->data |= bit & 1;
+	return bit & 1;
+}
+
+unsigned descramble_bit(struct scrambler *s, unsigned bit)
+{
+	if (bit & 1)
+		s->one_count++;
+	else
+		s->one_count = 0;
+	s->data <<= 1;
+	s->data |= bit & 1;
+	bit ^= (s->data >> 14) ^ (s->data >> 17);
+	if (s->one_count == 64 + 1) {
+		bit ^= 1;
+		s->one_count = 1;
+	}
+	return bit & 1;
+}
+
+/* new count of trailing (most recent) ones */
+static inline unsigned count_ones(unsigned count, unsigned bits,
+				  unsigned num)
+{
+	bits &= bits_mask(num);
+	if (bits == bits_mask(num))
+		return count + num;
+	return __builtin_ctz(~bits);
+}
+
+static unsigned scramble_word(struct scrambler *s, unsigned bits,
+			      unsigned num)
+{
+	unsigned i, out = 0;
+	if (s->one_count > 64 - num) {
+		for (i = num; i-- > 0;)
+			out = (out << 1) | scramble_bit(s, (bits >> i) & 1);
+		return out;
+	}
+	out = (bits ^ (s->data >> (14 - num)) ^ (s->data >> (17 - num))) &
+	    bits_mask(num);
+	s->data = (s->data << num) | out;
+	s->one_count = count_ones(s->one_count, out, num);
+	return out;
+}
+
+static unsigned descramble_word(struct scrambler *s, unsigned bits,
+				unsigned num)
+{
+	unsigned i, out = 0;
+	if (s->one_count + num > 64) {
+		for (i = num; i-- > 0;)
+			out = (out << 1) | descramble_bit(s, (bits >> i) & 1);
+		return out;
+	}
+	bits &= bits_mask(num);
+	s->data = (s->data << num) | bits;
+	out = (bits ^ (s->data >> 14) ^ (s->data >> 17)) & bits_mask(num);
+	s->one_count = count_ones(s->one_count, bits, num);
+	return out;
+}
+
+#ifdef SCRAMBLER_CHECK
+static void scrambler_check(const char *name, struct scrambler *ref,
+			    unsigned (*func) (struct scrambler *, unsigned),
+			    unsigned bits, unsigned num, unsigned out,
+			    struct scrambler *s)
+{
+	unsigned i, ref_out = 0;
+	for (i = num; i-- > 0;)
+		ref_out = (ref_out << 1) | func(ref, (bits >> i) & 1);
+	if (ref_out != out || ref->one_count != s->one_count ||
+	    (ref->data ^ s->data) & bits_mask(17))
+		err("%s mismatch: %x/%u -> %x (ref %x), count %u (ref %u)\n",
+		    name, bits, num, out, ref_out, s->one_count,
+		    ref->one_count);
+}
+#endif
+
+unsigned scramble_bits(struct scrambler *s, unsigned bits, unsigned num)
+{
+	unsigned n, left = num, out = 0;
+#ifdef SCRAMBLER_CHECK
+	struct scrambler ref = *s;
+#endif
+	while (left) {
+		n = left > SCRAMBLER_STEP ? SCRAMBLER_STEP : left;
+		left -= n;
+		out = (out << n) | scramble_word(s, bits >> left, n);
+	}
+#ifdef SCRAMBLER_CHECK
+	scrambler_check("scrambler", &ref, scramble_bit, bits, num, out, s);
+#endif
+	return out;
+}
+
+unsigned descramble_bits(struct scrambler *s, unsigned bits, unsigned num)
+{
+#ifdef SCRAMBLER_CHECK
+	struct scrambler ref = *s;
+#endif
+	unsigned out = descramble_word(s, bits, num);
+#ifdef SCRAMBLER_CHECK
+	scrambler_check("descrambler", &ref, descramble_bit, bits, num, out, s);
+#endif
+	return out;
+}
@@ -0,0 +1,261 @@
+/*
+ *   M - yet another soft modem
+ *
+ *   Copyright (c) 2005 Sasha Khapyorsky <sashak@alsa-project.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA
+ *
+ */
+
+/*
+ *   tonedet.c - tone and call progress signals detector
+ *
+ *   Tones run as lanes of one vector, signals sharing a frequency share
+ *   the lane and just or their masks.  Two modes:
+ *
+ *   block - Goertzel filter bank, every sample costs one multiply-add per
+ *           tone, decided and restarted each TONEDET_WINDOW samples;
+ *   sliding - correlation over the last TONEDET_WINDOW samples, products
+ *           leaving the window are kept and subtracted, so sums are exact
+ *           and cost per sample is constant; decided each 'step' samples.
+ *
+ *   Tone decisions have hysteresis against both window energy and the
+ *   noise floor, which is tracked from windows with no tone on.  A signal
+ *   is present when all its tones are on.  Continuous signals are detected
+ *   once present for 'min_on', cadenced ones after a whole on/off cycle
+ *   of right lengths, and both are gone as soon as it breaks.
+ */
+
+#include <string.h>
+
+#include "m_dsp.h"
+
+#define TONEDET_SHIFT 8		/* input prescale */
+
+#define TONEDET_MIN_ENERGY 10000	/* squelch */
+#define TONEDET_ON_RATIO 20	/* tone energy against window energy */
+#define TONEDET_OFF_RATIO 10
+#define TONEDET_ON_SNR 0	/* tone power against noise floor, log2 */
+#define TONEDET_OFF_SNR 1
+#define TONEDET_FLOOR_RISE 14	/* noise floor rise time, log2 samples */
+#define TONEDET_CADENCE_TOL 2	/* cadence tolerance, log2 fraction */
+
+/* 2cos(2 pi freq / SAMPLE_RATE), costab linearly interpolated */
+int32_t tonedet_coeff(unsigned freq)
+{
+	uint32_t phase = NCO_PHINC(freq);
+	unsigned i = phase >> NCO_SHIFT;
+	int32_t frac = (phase >> (NCO_SHIFT - 16)) & 0xffff;
+	int32_t c0 = costab[i];
+	int32_t c1 = costab[(i + 1) & (COSTAB_SIZE - 1)];
+	int32_t c = c0 + (((c1 - c0) * frac) >> 16);
+	return c >> (COSTAB_SHIFT - TONEDET_COEFF_SHIFT - 1);
+}
+
+void tonedet_init(struct tonedet *t, unsigned step, unsigned min_on)
+{
+	memset(t, 0, sizeof(*t));
+	t->step = step > TONEDET_WINDOW ? TONEDET_WINDOW : step;
+	t->min_on = min_on;
+}
+
+static int tonedet_add_tone(struct tonedet *t, unsigned mask, unsigned freq)
+{
+	unsigned i;
+	for (i = 0; i < t->num; i++)
+		if (t->freq[i] == freq) {
+			t->mask[i] |= mask;
+			return 0;
+		}
+	if (t->num >= TONEDET_MAX)
+		return -1;
+	t->mask[i] = mask;
+	t->freq[i] = freq;
+	t->coeff[i] = tonedet_coeff(freq);
+	t->phinc[i] = NCO_PHINC(freq);
+	t->num++;
+	return 0;
+}
+
+int tonedet_add_signal(struct tonedet *t, unsigned id)
+{
+	const struct signal_desc *desc = &signal_descs[id];
+	struct tonedet_signal *s;
+	if (t->num_signals >= TONEDET_MAX ||
+	    tonedet_add_tone(t, MASK(id), desc->freq) < 0 ||
+	    (desc->freq2 && tonedet_add_tone(t, MASK(id), desc->freq2) < 0)) {
+		err("no room to detect %s\n", desc->name);
+		return -1;
+	}
+	s = &t->signals[t->num_signals++];
+	s->mask = MASK(id);
+	s->on = samples_in_msec(desc->on);
+	s->off = samples_in_msec(desc->off);
+	return 0;
+}
+
+static inline void tonedet_update(struct tonedet *t, int32_t sample)
+{
+	tonedet_vec s0;
+	s0 = sample + ((t->coeff * t->s1) >> TONEDET_COEFF_SHIFT) - t->s2;
+	t->s2 = t->s1;
+	t->s1 = s0;
+}
+
+static inline void tonedet_slide(struct tonedet *t, unsigned idx,
+				 int32_t sample)
+{
+	tonedet_vec c = { 0 }, sn = { 0 }, px, py;
+	unsigned i;
+	for (i = 0; i < t->num; i++) {
+		c[i] = nco_cos(t->phase[i]);
+		sn[i] = nco_sin(t->phase[i]);
+	}
+	px = sample * c;
+	py = sample * sn;
+	t->x += px - t->hist_x[idx];
+	t->y += py - t->hist_y[idx];
+	t->hist_x[idx] = px;
+	t->hist_y[idx] = py;
+	t->phase += t->phinc;
+}
+
+/* squared magnitude of the tone over the block */
+static inline int64_t tonedet_energy(struct tonedet *t, unsigned i)
+{
+	int64_t s1 = t->s1[i], s2 = t->s2[i];
+	return s1 * s1 + s2 * s2 -
+	    ((t->coeff[i] * s1 * s2) >> TONEDET_COEFF_SHIFT);
+}
+
+/* the same over the sliding window */
+static inline int64_t tonedet_slide_energy(struct tonedet *t, unsigned i)
+{
+	int64_t x = t->x[i] >> COSTAB_SHIFT, y = t->y[i] >> COSTAB_SHIFT;
+	return x * x + y * y;
+}
+
+static inline int tonedet_evaluate(struct tonedet *t, int64_t te, int on)
+{
+	int64_t energy = t->energy;
+	/* the tone share of window energy */
+	int64_t power = 2 * te / TONEDET_WINDOW;
+	if (energy <= TONEDET_MIN_ENERGY)
+		return 0;
+	if (on)
+		return te > TONEDET_OFF_RATIO * energy &&
+		    power << TONEDET_OFF_SNR > t->noise_floor;
+	return te > TONEDET_ON_RATIO * energy &&
+	    power << TONEDET_ON_SNR > t->noise_floor;
+}
+
+static inline int cadence_match(unsigned time, unsigned nominal)
+{
+	unsigned tol = nominal >> TONEDET_CADENCE_TOL;
+	return time >= nominal - tol && time <= nominal + tol;
+}
+
+static void tonedet_signal_update(struct tonedet *t, struct tonedet_signal *s,
+				  unsigned present, unsigned elapsed)
+{
+	if (present != s->present) {
+		if (present)
+			s->detected = s->off && cadence_match(s->last_on, s->on)
+			    && cadence_match(s->time, s->off);
+		else
+			s->last_on = s->time;
+		s->present = present;
+		s->time = 0;
+	}
+	s->time += elapsed;
+	if (!s->off)
+		s->detected = present && s->time >= t->min_on;
+	else if (s->time > (present ? s->on + (s->on >> TONEDET_CADENCE_TOL) :
+			    s->off + (s->off >> TONEDET_CADENCE_TOL)))
+		s->detected = 0;
+}
+
+/* te[] are tone energies over the window, num_samples since last call */
+static void tonedet_decide(struct tonedet *t, const int64_t * te)
+{
+	unsigned elapsed = t->num_samples;
+	unsigned any = 0, missing = 0, detected = 0, i;
+
+	/* quiet windows pull the floor down at once, louder ones creep it
+	 * up, unless it is a tone */
+	if (t->energy < t->noise_floor)
+		t->noise_floor -= (t->noise_floor - t->energy) >> 2;
+	else if (!t->tones_on)
+		t->noise_floor += ((int64_t) (t->energy - t->noise_floor) *
+				   elapsed) >> TONEDET_FLOOR_RISE;
+
+	for (i = 0; i < t->num; i++) {
+		//dbg("tonedet %u: toneE = %lld, E = %d, floor = %d\n",
+		//    t->freq[i], (long long)te[i], t->energy, t->noise_floor);
+		if (tonedet_evaluate(t, te[i], t->tones_on & MASK(i))) {
+			t->tones_on |= MASK(i);
+			any |= t->mask[i];
+		} else {
+			t->tones_on &= ~MASK(i);
+			missing |= t->mask[i];
+		}
+	}
+	any &= ~missing;
+
+	for (i = 0; i < t->num_signals; i++) {
+		struct tonedet_signal *s = &t->signals[i];
+		tonedet_signal_update(t, s, !!(any & s->mask), elapsed);
+		if (s->detected)
+			detected |= s->mask;
+	}
+	t->detected = detected;
+	t->num_samples = 0;
+}
+
+unsigned tonedet_process(struct tonedet *t, int16_t * buf, unsigned count)
+{
+	int64_t te[TONEDET_MAX];
+	unsigned detected = t->detected;
+	unsigned i, j;
+
+	for (i = 0; i < count && t->detected == detected; i++) {
+		int32_t sample = buf[i] >> TONEDET_SHIFT;
+		if (!t->step) {
+			t->energy += sample * sample;
+			tonedet_update(t, sample);
+			if (++t->num_samples < TONEDET_WINDOW)
+				continue;
+			for (j = 0; j < t->num; j++)
+				te[j] = tonedet_energy(t, j);
+			tonedet_decide(t, te);
+			memset(&t->s1, 0, sizeof(t->s1));
+			memset(&t->s2, 0, sizeof(t->s2));
+			t->energy = 0;
+		} else {
+			unsigned idx = t->hist_index;
+			t->energy += sample * sample - t->hist_energy[idx];
+			t->hist_energy[idx] = sample * sample;
+			tonedet_slide(t, idx, sample);
+			t->hist_index = (idx + 1) & (TONEDET_WINDOW - 1);
+			if (++t->num_samples < t->step)
+				continue;
+			for (j = 0; j < t->num; j++)
+				te[j] = tonedet_slide_energy(t, j);
+			tonedet_decide(t, te);
+		}
+	}
+	return i;
+}
@@ -28,11 +28,6 @@
 
 #define V22_FRAG 256
 
-struct scrambler {
-	uint32_t data;
-	unsigned int one_count;
-};
-
 struct v22_struct {
 	struct modem *modem;
 	unsigned count1, count2;	/* for negotiation flow */
@@ -40,16 +35,12 @@ struct v22_struct {
 	struct psk_demodulator dem;
 	struct psk_modulator mod;
 	struct scrambler scram, descr;
+	unsigned rx_bits, rx_nbits;	/* line bits for descrambler */
+	unsigned tx_bits, tx_nbits;	/* scrambled, prefetched */
 	void (*run_func) (struct v22_struct * s, int16_t * in, int16_t * out,
 			  unsigned cnt);
-	struct fbuf {
-		const int16_t *filter;
-		unsigned size;
-		unsigned index;
-		int16_t *history;
-	} rx_fbuf, tx_fbuf;
+	struct fir rx_fir;
 	int16_t rx_samples[V22_FRAG];
-	int16_t tx_samples[V22_FRAG];
 };
 
 static void v22_run_dem(struct v22_struct *s, int16_t * in, int16_t * out,
@@ -59,60 +50,47 @@ static void v22_run_mod(struct v22_struct *s, int16_t * in, int16_t * out,
 static void v22_run_both(struct v22_struct *s, int16_t * in, int16_t * out,
 			 unsigned cnt);
 
-/* scrambler */
+/* get/put symbol stuff - negotiation flow is here too */
 
-static unsigned scramble_bit(struct scrambler *s, unsigned bit)
-{
-	bit = bit ^ (s->data >> (14 - 1)) ^ (s->data >> (17 - 1));
-	if (s->one_count == 64) {
-		bit ^= 1;
-		s->one_count = 0;
-	}
-	if (bit & 1)
-		s->one_count++;
-	else
-		s->one_count = 0;
-	s->data <<= 1;
-	s->data |= bit & 1;
-	return bit & 1;
-}
+/* data bits go in spans: a period worth of symbols is fetched at once,
+ * received bits are passed up when v22_process() is done */
+#define V22_TX_BITS (2 * 600 * PERIOD_SIZE / SAMPLE_RATE)
 
-static unsigned descramble_bit(struct scrambler *s, unsigned bit)
+static unsigned v22_get_data_symbol(struct modem *m)
 {
-	if (bit & 1)
-		s->one_count++;
-	else
-		s->one_count = 0;
-	s->data <<= 1;
-	s->data |= bit & 1;
-	bit ^= (s->data >> 14) ^ (s->data >> 17);
-	if (s->one_count == 64 + 1) {
-		bit ^= 1;
-		s->one_count = 1;
+	struct v22_struct *s = (struct v22_struct *)m->datapump.dp;
+	if (s->tx_nbits < 2) {
+		s->tx_bits = scramble_bits(&s->scram,
+					   modem_get_bits(m, V22_TX_BITS),
+					   V22_TX_BITS);
+		s->tx_nbits = V22_TX_BITS;
 	}
-	return bit & 1;
+	s->tx_nbits -= 2;
+	return (s->tx_bits >> s->tx_nbits) & 0x3;
 }
 
-/* get/put symbol stuff - negotiation flow is here too */
-
-static unsigned v22_get_data_symbol(struct modem *m)
+static void v22_flush_data_bits(struct v22_struct *s)
 {
-	struct scrambler *s = &((struct v22_struct *)(m->datapump.dp))->scram;
-	return (scramble_bit(s, modem_get_bits(m, 1)) << 1) |
-	    scramble_bit(s, modem_get_bits(m, 1));
+	if (s->rx_nbits)
+		modem_put_bits(s->modem,
+			       descramble_bits(&s->descr, s->rx_bits,
+					       s->rx_nbits), s->rx_nbits);
+	s->rx_bits = s->rx_nbits = 0;
 }
 
 static void v22_put_data_symbol(struct modem *m, unsigned symbol)
 {
-	struct scrambler *d = &((struct v22_struct *)(m->datapump.dp))->descr;
-	modem_put_bits(m, descramble_bit(d, (symbol >> 1) & 1), 1);
-	modem_put_bits(m, descramble_bit(d, symbol & 1), 1);
+	struct v22_struct *s = (struct v22_struct *)m->datapump.dp;
+	s->rx_bits = (s->rx_bits << 2) | (symbol & 0x3);
+	s->rx_nbits += 2;
+	if (s->rx_nbits == ASYNC_MAX_BITS)
+		v22_flush_data_bits(s);
 }
 
 static unsigned v22_get_scram_symbol(struct modem *m)
 {
 	struct scrambler *s = &((struct v22_struct *)(m->datapump.dp))->scram;
-	return (scramble_bit(s, 1) << 1) | scramble_bit(s, 1);
+	return scramble_bits(s, 0x3, 2);
 }
 
 static void v22_put_scram_symbol(struct modem *m, unsigned symbol)
@@ -122,8 +100,7 @@ static void v22_put_scram_symbol(struct modem *m, unsigned symbol)
 	unsigned bits;
 	unsigned mask;
 
-	bits = (descramble_bit(d, (symbol >> 1) & 1) << 1) |
-	    descramble_bit(d, symbol & 1);
+	bits = descramble_bits(d, symbol, 2);
 	mask = (1 << 2) - 1;
 
 	if (bits == mask || s->count1 > 162) {	/* bits: 600*0.270 sec */
@@ -179,48 +156,12 @@ static void v22_put_raw_symbol(struct modem *m, unsigned symbol)
 	}
 }
 
-/* fbuf (filter buffer) stuff */
-
-static void fbuf_filter_samples(struct fbuf *f, int16_t * in, int16_t * out,
-				unsigned count)
-{
-	int i;
-	for (i = 0; i < count; i++) {
-		unsigned j, idx;
-		int32_t sum = 0;
-		f->history[f->index] = in[i];
-		f->index = (f->index + 1) % f->size;
-		idx = f->index;
-		for (j = 0; j < f->size; j++) {
-			sum += f->filter[j] * f->history[idx];
-			idx = (idx + 1) % f->size;
-		}
-		out[i] = sum >> COSTAB_SHIFT;
-	}
-}
-
-static int fbuf_init(struct fbuf *f, const int16_t * filter, unsigned size)
-{
-	memset(f, 0, sizeof(*f));
-	f->filter = filter;
-	f->size = size;
-	f->history = malloc(size * sizeof(*f->history));
-	if (!f->history)
-		return -1;
-	return 0;
-}
-
-static void fbuf_free(struct fbuf *f)
-{
-	free(f->history);
-}
-
 /* v22 processors */
 
 static void v22_run_dem(struct v22_struct *s, int16_t * in, int16_t * out,
 			unsigned cnt)
 {
-	fbuf_filter_samples(&s->rx_fbuf, in, s->rx_samples, cnt);
+	fir_filter(&s->rx_fir, in, s->rx_samples, cnt);
 	//log_data(27, s->rx_samples, cnt*sizeof(*s->rx_samples));
 	psk_demodulate(&s->dem, s->rx_samples, cnt);
 	memset(out, 0, cnt * sizeof(*out));
@@ -229,17 +170,15 @@ static void v22_run_dem(struct v22_struct *s, int16_t * in, int16_t * out,
 static void v22_run_mod(struct v22_struct *s, int16_t * in, int16_t * out,
 			unsigned cnt)
 {
-	psk_modulate(&s->mod, s->tx_samples, cnt);
-	fbuf_filter_samples(&s->tx_fbuf, s->tx_samples, out, cnt);
+	psk_modulate(&s->mod, out, cnt);
 }
 
 static void v22_run_both(struct v22_struct *s, int16_t * in, int16_t * out,
 			 unsigned cnt)
 {
-	fbuf_filter_samples(&s->rx_fbuf, in, s->rx_samples, cnt);
+	fir_filter(&s->rx_fir, in, s->rx_samples, cnt);
 	psk_demodulate(&s->dem, s->rx_samples, cnt);
-	psk_modulate(&s->mod, s->tx_samples, cnt);
-	fbuf_filter_samples(&s->tx_fbuf, s->tx_samples, out, cnt);
+	psk_modulate(&s->mod, out, cnt);
 }
 
 static int v22_process(struct modem *m, int16_t * in, int16_t * out,
@@ -262,26 +201,23 @@ static int v22_process(struct modem *m, int16_t * in, int16_t * out,
 		out += cnt;
 		s->samples_count += cnt;
 	}
+	v22_flush_data_bits(s);
 
 	return ret;
 }
 
 struct channel_config {
 	unsigned fc;
-	const int16_t *filter;
-	unsigned filter_size;
 	const int16_t *rx_fir;	// FIXME: remove it
 	unsigned rx_fir_size;
 };
 
 const static struct channel_config v22_high_ch = {
-	2400, v22_rrc_2400, arrsize(v22_rrc_2400),
-	v22_bp_2400, arrsize(v22_bp_2400)
+	2400, v22_bp_2400, arrsize(v22_bp_2400)
 };
 
 const static struct channel_config v22_low_ch = {
-	1200, v22_rrc_1200, arrsize(v22_rrc_1200),
-	v22_bp_1200, arrsize(v22_bp_1200)
+	1200, v22_bp_1200, arrsize(v22_bp_1200)
 };
 
 static void *v22_create(struct modem *m)
@@ -299,10 +235,11 @@ static void *v22_create(struct modem *m)
 	rx = m->caller ? &v22_high_ch : &v22_low_ch;
 	tx = m->caller ? &v22_low_ch : &v22_high_ch;
 
-	psk_demodulator_init(&s->dem, m, rx->fc, 600);
-	psk_modulator_init(&s->mod, m, tx->fc, 600);
-	if (fbuf_init(&s->rx_fbuf, rx->rx_fir, rx->rx_fir_size) < 0 ||
-	    fbuf_init(&s->tx_fbuf, tx->filter, tx->filter_size) < 0) {
+	if (psk_demodulator_init(&s->dem, m, rx->fc, 600,
+				 v22_rrc_600, arrsize(v22_rrc_600)) < 0 ||
+	    psk_modulator_init(&s->mod, m, tx->fc, 600,
+			       v22_rrc_600, arrsize(v22_rrc_600)) < 0 ||
+	    fir_init(&s->rx_fir, rx->rx_fir, rx->rx_fir_size) < 0) {
 		free(s);
 		return NULL;
 	}
@@ -323,8 +260,7 @@ static void *v22_create(struct modem *m)
 static void v22_delete(void *data)
 {
 	struct v22_struct *s = (struct v22_struct *)data;
-	fbuf_free(&s->rx_fbuf);
-	fbuf_free(&s->tx_fbuf);
+	fir_free(&s->rx_fir);
 	free(s);
 }
 